@@ -13,10 +13,17 @@
 
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <limits>
 #ifndef NDEBUG
 #include <iostream>
 #endif
+extern "C" {
+  #include <libavutil/imgutils.h>
+  #include <libavutil/time.h>
+  #include <libavutil/motion_vector.h>
+}
 #include "avinput.hh"
+#include "framecache.hh"
 
 #if !defined(INT64_C)
 #define INT64_C(c) c ## LL
@@ -28,15 +35,42 @@ using namespace std;
 
 VALUE AVInput::cRubyClass = Qnil;
 
-AVInput::AVInput( const string &mrl, bool audio ) throw (Error):
+const rb_data_type_t AVInput::dataType = {
+  "Hornetseye::AVInput",
+  { markRubyObject, deleteRubyObject, memorySizeRubyObject, 0, { 0 } },
+  0, 0, 0
+};
+
+AVInput::AVInput( const string &mrl, bool audio, bool gray, bool live,
+                  double maxLatency, bool motionVectors ) throw (Error):
   m_mrl( mrl ), m_ic( NULL ), m_videoDec( NULL ), m_audioDec( NULL ),
   m_videoCodec( NULL ), m_audioCodec( NULL ),
-  m_videoStream( -1 ), m_audioStream( -1 ), m_videoPts( 0 ), m_audioPts( 0 ),
-  m_swsContext(NULL), m_vFrame(NULL), m_aFrame(NULL)
+  m_videoStream( -1 ), m_audioStream( -1 ), m_gray( gray ), m_live( live ),
+  m_maxLatency( (long long)( maxLatency * AV_TIME_BASE ) ), m_latency( 0 ),
+  m_wallStart( AV_NOPTS_VALUE ), m_ptsStart( AV_NOPTS_VALUE ),
+  m_exportMotionVectors( motionVectors ), m_pictureType( '?' ), m_qpStride( 0 ),
+  m_videoPts( 0 ), m_audioPts( 0 ),
+  m_swsContext(NULL), m_vFrame(NULL), m_aFrame(NULL), m_cacheSize( 0 ),
+  m_cacheBytes( 0 ), m_cursor( AV_NOPTS_VALUE ), m_served( AV_NOPTS_VALUE ),
+  m_resync( AV_NOPTS_VALUE ), m_seekTarget( AV_NOPTS_VALUE ),
+  m_lastDecoded( AV_NOPTS_VALUE ), m_eof( false ), m_rbFrameCache( Qnil ),
+  m_frameCacheIndex( 0 )
 {
   try {
+    ERRORMACRO( !m_live || m_maxLatency > 0, Error, , "Maximum latency must be "
+                "positive (but was " << maxLatency << ")" );
     av_register_all();
-    int err = avformat_open_input(&m_ic, mrl.c_str(), NULL, NULL);
+    AVDictionary *options = NULL;
+    if ( m_live ) {
+      // Disable demuxer buffering and keep stream probing short.
+      m_ic = avformat_alloc_context();
+      ERRORMACRO( m_ic != NULL, Error, , "Failure allocating format context" );
+      m_ic->flags |= AVFMT_FLAG_NOBUFFER;
+      av_dict_set( &options, "probesize", "32768", 0 );
+      av_dict_set( &options, "analyzeduration", "500000", 0 );
+    };
+    int err = avformat_open_input(&m_ic, mrl.c_str(), NULL, &options);
+    av_dict_free( &options );
     ERRORMACRO( err >= 0, Error, , "Error opening file \"" << mrl << "\": "
                 << strerror( errno ) );
     err = avformat_find_stream_info(m_ic, NULL);
@@ -58,16 +92,24 @@ AVInput::AVInput( const string &mrl, bool audio ) throw (Error):
       m_videoCodec = avcodec_find_decoder( m_videoDec->codec_id );
       ERRORMACRO( m_videoCodec != NULL, Error, , "Could not find video decoder for "
                   "file \"" << mrl << "\"" );
-      err = avcodec_open2(m_videoDec, m_videoCodec, NULL);
+      if ( m_live ) m_videoDec->flags |= CODEC_FLAG_LOW_DELAY;
+      AVDictionary *decoderOptions = NULL;
+      if ( m_exportMotionVectors )
+        av_dict_set( &decoderOptions, "flags2", "+export_mvs", 0 );
+      err = avcodec_open2(m_videoDec, m_videoCodec, &decoderOptions);
+      av_dict_free( &decoderOptions );
       if ( err < 0 ) {
         m_videoCodec = NULL;
         ERRORMACRO( false, Error, , "Error opening video codec for file \""
                     << mrl << "\": " << strerror( errno ) );
       };
-      m_swsContext = sws_getContext( m_videoDec->width, m_videoDec->height,
-                                     m_videoDec->pix_fmt,
-                                     m_videoDec->width, m_videoDec->height,
-                                     AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR, 0, 0, 0 );
+      // In grayscale mode the luma plane is copied directly if possible.
+      if ( !m_gray || !lumaPlanar( m_videoDec->pix_fmt ) )
+        m_swsContext = sws_getContext( m_videoDec->width, m_videoDec->height,
+                                       m_videoDec->pix_fmt,
+                                       m_videoDec->width, m_videoDec->height,
+                                       m_gray ? AV_PIX_FMT_GRAY8 : AV_PIX_FMT_YUV420P,
+                                       SWS_FAST_BILINEAR, 0, 0, 0 );
       m_vFrame = av_frame_alloc();
       ERRORMACRO(m_vFrame, Error, , "Error allocating frame");
     };
@@ -99,6 +141,9 @@ AVInput::~AVInput(void)
 
 void AVInput::close(void)
 {
+  clearCache();
+  m_frameCache.reset();
+  m_rbFrameCache = Qnil;
   m_audioFrame.reset();
   m_videoFrame.reset();
   if (m_vFrame) {
@@ -134,13 +179,65 @@ void AVInput::close(void)
 
 void AVInput::readAV(void) throw (Error)
 {
+  if ( m_frameCache.get() ) {
+    // Frames are served from the mapped cache file without decoding.
+    m_audioFrame.reset();
+    m_videoFrame.reset();
+    m_motionVectors.reset();
+    m_qpTable.reset();
+    ERRORMACRO( m_frameCacheIndex < m_frameCache->size(), Error, ,
+                "No more frames available" );
+    m_videoFrame = m_frameCache->frame( m_frameCacheIndex, m_rbFrameCache );
+    m_videoPts = m_frameCache->pts( m_frameCacheIndex++ );
+    m_pictureType = '?';
+    return;
+  };
+  if ( readCache() ) return;
+  if ( m_seekTarget != AV_NOPTS_VALUE ) {
+    // Decode from the keyframe before the seek target. The frames on the way
+    // are cached so that seeking returns the same frame as for a cache hit.
+    long long target = m_seekTarget;
+    m_seekTarget = AV_NOPTS_VALUE;
+    do
+      decodeAV();
+    while ( !m_videoFrame.get() || m_videoPts < target );
+  } else if ( m_resync != AV_NOPTS_VALUE ) {
+    // Continue decoding after the last frame served from the cache.
+    ERRORMACRO( m_ic != NULL, Error, , "Video \"" << m_mrl << "\" is not open. "
+                "Did you call \"close\" before?" );
+    long long last = m_resync;
+    m_resync = AV_NOPTS_VALUE;
+    ERRORMACRO( av_seek_frame( m_ic, m_videoStream, last,
+                               AVSEEK_FLAG_BACKWARD ) >= 0,
+                Error, , "Error seeking in video \"" << m_mrl << "\"" );
+    if ( m_videoDec != NULL ) avcodec_flush_buffers( m_videoDec );
+    if ( m_audioDec != NULL ) avcodec_flush_buffers( m_audioDec );
+    m_lastDecoded = AV_NOPTS_VALUE;
+    do
+      decodeAV();
+    while ( !m_videoFrame.get() || m_videoPts <= last );
+  } else
+    decodeAV();
+}
+
+void AVInput::decodeAV(void) throw (Error)
+{
+  m_eof = false;
   m_audioFrame.reset();
   m_videoFrame.reset();
+  m_motionVectors.reset();
+  m_qpTable.reset();
   ERRORMACRO( m_ic != NULL, Error, , "Video \"" << m_mrl << "\" is not open. "
               "Did you call \"close\" before?" );
   AVPacket packet;
   long long firstPacketPts = AV_NOPTS_VALUE;
-  while ( av_read_frame( m_ic, &packet ) >= 0 ) {
+  int status;
+  while ( ( status = av_read_frame( m_ic, &packet ) ) >= 0 ) {
+    if ( m_live && updateLatency( packet ) ) {
+      // Consumer fell behind: drop stale audio before decoding it.
+      av_free_packet( &packet );
+      continue;
+    };
     if ( packet.stream_index == m_videoStream ) {
       int frameFinished;
       int err = avcodec_decode_video2( m_videoDec, m_vFrame, &frameFinished,
@@ -154,24 +251,9 @@ void AVInput::readAV(void) throw (Error)
         else
           m_videoPts = firstPacketPts;
         av_free_packet( &packet );
-        AVFrame picture;
-        m_videoFrame = FramePtr( new Frame( "YV12", m_videoDec->width,
-                                            m_videoDec->height ) );
-        int
-          width   = m_videoDec->width,
-          height  = m_videoDec->height,
-          width2  = ( width  + 1 ) / 2,
-          height2 = ( height + 1 ) / 2,
-          widtha  = ( width  + 7 ) & ~0x7,
-          width2a = ( width2 + 7 ) & ~0x7;
-        picture.data[0] = (uint8_t *)m_videoFrame->data();
-        picture.data[2] = (uint8_t *)m_videoFrame->data() + widtha * height;
-        picture.data[1] = (uint8_t *)picture.data[2] + width2a * height2;
-        picture.linesize[0] = widtha;
-        picture.linesize[1] = width2a;
-        picture.linesize[2] = width2a;
-        sws_scale( m_swsContext, m_vFrame->data, m_vFrame->linesize, 0,
-                   m_videoDec->height, picture.data, picture.linesize );
+        convertVideo();
+        exportSideData();
+        cacheFrame();
         break;
       } else
         av_free_packet( &packet );
@@ -198,10 +280,202 @@ void AVInput::readAV(void) throw (Error)
         av_free_packet( &packet );
     };
   };
+  // Any other failure than the end of the file is an error of its own.
+  m_eof = status == AVERROR_EOF;
+  ERRORMACRO( status >= 0 || m_eof, Error, ,
+              "Error reading frame of file \"" << m_mrl << "\"" );
   ERRORMACRO( m_videoFrame.get() || m_audioFrame.get(), Error, ,
               "No more frames available" );
 }
 
+bool AVInput::readCache(void)
+{
+  if ( m_cursor == AV_NOPTS_VALUE ) return false;
+  map< long long, CacheEntry >::iterator i = m_cache.find( m_cursor );
+  m_cursor = AV_NOPTS_VALUE;
+  if ( i == m_cache.end() ) {
+    // The frame was evicted in the meantime and has to be decoded again.
+    m_resync = m_served;
+    return false;
+  };
+  m_audioFrame.reset();
+  m_videoFrame = i->second.frame;
+  m_motionVectors = i->second.motionVectors;
+  m_qpTable = i->second.qpTable;
+  m_qpStride = i->second.qpStride;
+  m_pictureType = i->second.pictureType;
+  m_videoPts = i->first;
+  m_served = i->first;
+  m_cursor = i->second.next;
+  // Without a cached successor decoding resumes after this frame.
+  if ( m_cursor == AV_NOPTS_VALUE ) m_resync = m_served;
+  m_cacheLRU.splice( m_cacheLRU.begin(), m_cacheLRU, i->second.lru );
+  return true;
+}
+
+void AVInput::cacheFrame(void)
+{
+  if ( m_cacheSize == 0 ) return;
+  long long pts = m_videoPts;
+  map< long long, CacheEntry >::iterator i = m_cache.find( pts );
+  if ( i == m_cache.end() ) {
+    CacheEntry entry;
+    entry.prev = AV_NOPTS_VALUE;
+    entry.next = AV_NOPTS_VALUE;
+    m_cacheLRU.push_front( pts );
+    entry.lru = m_cacheLRU.begin();
+    i = m_cache.insert( make_pair( pts, entry ) ).first;
+  } else {
+    m_cacheBytes -= i->second.storageSize();
+    m_cacheLRU.splice( m_cacheLRU.begin(), m_cacheLRU, i->second.lru );
+  };
+  i->second.frame = m_videoFrame;
+  i->second.motionVectors = m_motionVectors;
+  i->second.qpTable = m_qpTable;
+  i->second.qpStride = m_qpStride;
+  i->second.pictureType = m_pictureType;
+  m_cacheBytes += i->second.storageSize();
+  if ( m_lastDecoded != AV_NOPTS_VALUE && m_lastDecoded < pts ) {
+    // Frames decoded in sequence are linked so that stepping needs no decoding.
+    i->second.prev = m_lastDecoded;
+    map< long long, CacheEntry >::iterator p = m_cache.find( m_lastDecoded );
+    if ( p != m_cache.end() ) p->second.next = pts;
+  };
+  m_lastDecoded = pts;
+  evictCache();
+}
+
+void AVInput::evictCache(void)
+{
+  // The most recent frame is always kept.
+  while ( m_cacheBytes > m_cacheSize && m_cache.size() > 1 ) {
+    map< long long, CacheEntry >::iterator i = m_cache.find( m_cacheLRU.back() );
+    m_cacheBytes -= i->second.storageSize();
+    m_cache.erase( i );
+    m_cacheLRU.pop_back();
+  };
+}
+
+void AVInput::clearCache(void)
+{
+  m_cache.clear();
+  m_cacheLRU.clear();
+  m_cacheBytes = 0;
+}
+
+void AVInput::convertVideo(void) throw (Error)
+{
+  int
+    width   = m_videoDec->width,
+    height  = m_videoDec->height;
+  if ( m_gray ) {
+    m_videoFrame = FramePtr( new Frame( "UBYTE", width, height ) );
+    uint8_t *data = (uint8_t *)m_videoFrame->data();
+    if ( m_swsContext == NULL )
+      av_image_copy_plane( data, width, m_vFrame->data[0], m_vFrame->linesize[0],
+                           width, height );
+    else {
+      uint8_t *dst[4] = { data, NULL, NULL, NULL };
+      int dstStride[4] = { width, 0, 0, 0 };
+      sws_scale( m_swsContext, m_vFrame->data, m_vFrame->linesize, 0,
+                 height, dst, dstStride );
+    };
+  } else {
+    AVFrame picture;
+    m_videoFrame = FramePtr( new Frame( "YV12", width, height ) );
+    for ( int i=0; i<3; i++ ) {
+      picture.data[i] = (uint8_t *)m_videoFrame->plane( i );
+      picture.linesize[i] = m_videoFrame->lineSize( i );
+    };
+    sws_scale( m_swsContext, m_vFrame->data, m_vFrame->linesize, 0,
+               height, picture.data, picture.linesize );
+  };
+}
+
+void AVInput::exportSideData(void)
+{
+  m_pictureType = av_get_picture_type_char( m_vFrame->pict_type );
+  if ( !m_exportMotionVectors ) return;
+  AVFrameSideData *sideData =
+    av_frame_get_side_data( m_vFrame, AV_FRAME_DATA_MOTION_VECTORS );
+  int n = sideData != NULL ? sideData->size / sizeof( AVMotionVector ) : 0;
+  // Each motion vector is stored as seven 16-bit integers.
+  m_motionVectors = SequencePtr( new Sequence( n * 7 * sizeof( int16_t ) ) );
+  if ( n > 0 ) {
+    const AVMotionVector *mvs = (const AVMotionVector *)sideData->data;
+    int16_t *p = (int16_t *)m_motionVectors->data();
+    for ( int i=0; i<n; i++ ) {
+      *p++ = mvs[i].source;
+      *p++ = mvs[i].w;
+      *p++ = mvs[i].h;
+      *p++ = mvs[i].src_x;
+      *p++ = mvs[i].src_y;
+      *p++ = mvs[i].dst_x;
+      *p++ = mvs[i].dst_y;
+    };
+  };
+  int qpType;
+  const int8_t *qp = av_frame_get_qp_table( m_vFrame, &m_qpStride, &qpType );
+  if ( qp != NULL && m_qpStride > 0 ) {
+    int size = m_qpStride * ( ( m_videoDec->height + 15 ) / 16 );
+    m_qpTable = SequencePtr( new Sequence( size ) );
+    memcpy( m_qpTable->data(), qp, size );
+  } else
+    m_qpStride = 0;
+}
+
+bool AVInput::updateLatency( const AVPacket &packet )
+{
+  // Packets of other streams (e.g. subtitles) are not decoded.
+  if ( packet.stream_index != m_videoStream &&
+       packet.stream_index != m_audioStream ) return false;
+  long long ts = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+  if ( ts == AV_NOPTS_VALUE ) return false;
+  AVRational timeBase = m_ic->streams[ packet.stream_index ]->time_base;
+  long long now = av_gettime();
+  if ( m_wallStart == AV_NOPTS_VALUE ) {
+    m_wallStart = now;
+    m_ptsStart = av_rescale_q( ts, timeBase, AV_TIME_BASE_Q );
+  };
+  long long streamTime = av_rescale_q( ts, timeBase, AV_TIME_BASE_Q ) - m_ptsStart;
+  m_latency = now - m_wallStart - streamTime;
+  if ( m_latency < 0 ) {
+    // Packets arriving early only mean the source delivered a burst.
+    m_wallStart += m_latency;
+    m_latency = 0;
+  };
+  if ( m_videoDec != NULL ) {
+    if ( m_latency > 2 * m_maxLatency )
+      m_videoDec->skip_frame = AVDISCARD_NONKEY;
+    else if ( m_latency > m_maxLatency )
+      m_videoDec->skip_frame = AVDISCARD_NONREF;
+    else
+      m_videoDec->skip_frame = AVDISCARD_DEFAULT;
+  };
+  return packet.stream_index == m_audioStream && m_latency > m_maxLatency;
+}
+
+bool AVInput::lumaPlanar( enum AVPixelFormat pixFmt )
+{
+  switch ( pixFmt ) {
+  case AV_PIX_FMT_YUV420P:
+  case AV_PIX_FMT_YUVJ420P:
+  case AV_PIX_FMT_YUV422P:
+  case AV_PIX_FMT_YUVJ422P:
+  case AV_PIX_FMT_YUV444P:
+  case AV_PIX_FMT_YUVJ444P:
+  case AV_PIX_FMT_YUV440P:
+  case AV_PIX_FMT_YUVJ440P:
+  case AV_PIX_FMT_YUV410P:
+  case AV_PIX_FMT_YUV411P:
+  case AV_PIX_FMT_NV12:
+  case AV_PIX_FMT_GRAY8:
+    return true;
+  default:
+    return false;
+  };
+}
+
 bool AVInput::status(void) const
 {
   return m_ic != NULL;
@@ -211,6 +485,7 @@ int AVInput::width(void) const throw (Error)
 {
   ERRORMACRO( m_videoDec != NULL, Error, , "Video \"" << m_mrl << "\" is not open. "
               "Did you call \"close\" before?" );
+  if ( m_frameCache.get() ) return m_frameCache->width();
   return m_videoDec->width;
 }
 
@@ -218,6 +493,7 @@ int AVInput::height(void) const throw (Error)
 {
   ERRORMACRO( m_videoDec != NULL, Error, , "Video \"" << m_mrl << "\" is not open. "
               "Did you call \"close\" before?" );
+  if ( m_frameCache.get() ) return m_frameCache->height();
   return m_videoDec->height;
 }
 
@@ -294,13 +570,69 @@ long long AVInput::audioStartTime(void) throw (Error)
   return m_ic->streams[ m_audioStream ]->start_time;
 }
 
-void AVInput::seek( long long timestamp ) throw (Error)
+void AVInput::seek( long long timestamp, bool backward ) throw (Error)
 {
   ERRORMACRO( m_ic != NULL, Error, , "Video \"" << m_mrl << "\" is not open. "
               "Did you call \"close\" before?" );
-  ERRORMACRO( av_seek_frame( m_ic, -1, timestamp, 0 ) >= 0,
-              Error, , "Error seeking in video \"" << m_mrl << "\"" );
-  avcodec_flush_buffers( m_videoDec );
+  if ( m_frameCache.get() ) {
+    m_frameCacheIndex = m_frameCache->find( av_rescale_q( timestamp, AV_TIME_BASE_Q,
+                                                          m_frameCache->timeBase() ),
+                                            backward );
+    return;
+  };
+  m_seekTarget = AV_NOPTS_VALUE;
+  if ( m_cacheSize > 0 && m_videoStream >= 0 && !backward ) {
+    // With a cache, decoding continues up to the target in readAV.
+    m_seekTarget = av_rescale_q( timestamp, AV_TIME_BASE_Q, videoTimeBase() );
+    ERRORMACRO( av_seek_frame( m_ic, m_videoStream, m_seekTarget,
+                               AVSEEK_FLAG_BACKWARD ) >= 0,
+                Error, , "Error seeking in video \"" << m_mrl << "\"" );
+  } else
+    ERRORMACRO( av_seek_frame( m_ic, -1, timestamp,
+                               backward ? AVSEEK_FLAG_BACKWARD : 0 ) >= 0,
+                Error, , "Error seeking in video \"" << m_mrl << "\"" );
+  if ( m_videoDec != NULL ) avcodec_flush_buffers( m_videoDec );
+  if ( m_audioDec != NULL ) avcodec_flush_buffers( m_audioDec );
+  m_cursor = AV_NOPTS_VALUE;
+  m_served = AV_NOPTS_VALUE;
+  m_resync = AV_NOPTS_VALUE;
+  m_lastDecoded = AV_NOPTS_VALUE;
+}
+
+void AVInput::setFrameCache( FrameCachePtr frameCache, VALUE rbFrameCache )
+  throw (Error)
+{
+  ERRORMACRO( m_videoStream != -1, Error, , "Video \"" << m_mrl << "\" does not "
+              "have a video stream" );
+  m_frameCache = frameCache;
+  m_rbFrameCache = rbFrameCache;
+  m_frameCacheIndex = 0;
+}
+
+void AVInput::setCacheSize( size_t cacheSize )
+{
+  m_cacheSize = cacheSize;
+  if ( m_cacheSize == 0 )
+    clearCache();
+  else
+    evictCache();
+}
+
+bool AVInput::seekCache( long long timestamp ) throw (Error)
+{
+  if ( m_cache.empty() ) return false;
+  long long target = av_rescale_q( timestamp, AV_TIME_BASE_Q, videoTimeBase() );
+  map< long long, CacheEntry >::iterator i = m_cache.lower_bound( target );
+  if ( i == m_cache.end() ) return false;
+  // The cached frame must be the first frame at or after the target.
+  if ( i->first != target &&
+       ( i->second.prev == AV_NOPTS_VALUE || i->second.prev >= target ) )
+    return false;
+  m_cursor = i->first;
+  m_served = AV_NOPTS_VALUE;
+  m_resync = AV_NOPTS_VALUE;
+  m_seekTarget = AV_NOPTS_VALUE;
+  return true;
 }
 
 long long AVInput::videoPts(void) throw (Error)
@@ -317,11 +649,155 @@ long long AVInput::audioPts(void) throw (Error)
   return m_audioPts;
 }
 
+double AVInput::latency(void) const
+{
+  return (double)m_latency / AV_TIME_BASE;
+}
+
+void AVInput::fastDecode( int width, int height ) throw (Error)
+{
+  ERRORMACRO( m_videoCodec != NULL, Error, , "Video \"" << m_mrl << "\" is not open. "
+              "Did you call \"close\" before?" );
+  int lowres = 0;
+  while ( lowres < m_videoCodec->max_lowres &&
+          ( m_videoDec->width >> ( lowres + 1 ) ) >= width &&
+          ( m_videoDec->height >> ( lowres + 1 ) ) >= height )
+    lowres++;
+  avcodec_close( m_videoDec );
+  m_videoDec->lowres = lowres;
+  m_videoDec->skip_frame = AVDISCARD_NONKEY;
+  m_videoDec->skip_loop_filter = AVDISCARD_ALL;
+  m_videoDec->flags |= CODEC_FLAG_LOW_DELAY;
+  m_videoDec->flags2 |= CODEC_FLAG2_FAST;
+  int err = avcodec_open2( m_videoDec, m_videoCodec, NULL );
+  if ( err < 0 ) {
+    m_videoCodec = NULL;
+    ERRORMACRO( false, Error, , "Error reopening video codec for file \""
+                << m_mrl << "\": " << strerror( errno ) );
+  };
+}
+
+AVFrame *AVInput::decodeKeyFrame( long long timestamp ) throw (Error)
+{
+  ERRORMACRO( m_videoCodec != NULL, Error, , "Video \"" << m_mrl << "\" is not open. "
+              "Did you call \"close\" before?" );
+  ERRORMACRO( avformat_seek_file( m_ic, -1, numeric_limits< long long >::min(),
+                                  timestamp, numeric_limits< long long >::max(),
+                                  0 ) >= 0,
+              Error, , "Error seeking in video \"" << m_mrl << "\"" );
+  avcodec_flush_buffers( m_videoDec );
+  AVPacket packet;
+  int frameFinished = 0;
+  while ( !frameFinished && av_read_frame( m_ic, &packet ) >= 0 ) {
+    if ( packet.stream_index == m_videoStream ) {
+      int err = avcodec_decode_video2( m_videoDec, m_vFrame, &frameFinished,
+                                       &packet );
+      av_free_packet( &packet );
+      ERRORMACRO( err >= 0, Error, ,
+                  "Error decoding video frame of file \"" << m_mrl << "\"" );
+    } else
+      av_free_packet( &packet );
+  };
+  if ( !frameFinished ) {
+    // Flush delayed frame at end of file.
+    av_init_packet( &packet );
+    packet.data = NULL;
+    packet.size = 0;
+    avcodec_decode_video2( m_videoDec, m_vFrame, &frameFinished, &packet );
+  };
+  return frameFinished ? m_vFrame : NULL;
+}
+
+char AVInput::pictureType(void) const
+{
+  return m_pictureType;
+}
+
+SequencePtr AVInput::motionVectors(void) const
+{
+  return m_motionVectors;
+}
+
+SequencePtr AVInput::qpTable(void) const
+{
+  return m_qpTable;
+}
+
+int AVInput::qpStride(void) const
+{
+  return m_qpStride;
+}
+
+bool AVInput::readPacket( AVPacket *packet ) throw (Error)
+{
+  ERRORMACRO( m_ic != NULL, Error, , "Video \"" << m_mrl << "\" is not open. "
+              "Did you call \"close\" before?" );
+  while ( av_read_frame( m_ic, packet ) >= 0 ) {
+    if ( packet->stream_index == m_videoStream ||
+         packet->stream_index == m_audioStream )
+      return true;
+    av_free_packet( packet );
+  };
+  return false;
+}
+
+AVFrame *AVInput::decodeVideo( AVPacket *packet ) throw (Error)
+{
+  ERRORMACRO( m_videoDec != NULL, Error, , "Video \"" << m_mrl << "\" does not have "
+              "a video stream" );
+  AVPacket flush;
+  if ( packet == NULL ) {
+    // An empty packet returns frames delayed by the decoder.
+    av_init_packet( &flush );
+    flush.data = NULL;
+    flush.size = 0;
+    packet = &flush;
+  };
+  int frameFinished = 0;
+  ERRORMACRO( avcodec_decode_video2( m_videoDec, m_vFrame, &frameFinished,
+                                     packet ) >= 0, Error, ,
+              "Error decoding video frame of file \"" << m_mrl << "\"" );
+  return frameFinished ? m_vFrame : NULL;
+}
+
+AVFrame *AVInput::decodeAudio( AVPacket *packet ) throw (Error)
+{
+  ERRORMACRO( m_audioDec != NULL, Error, , "Video \"" << m_mrl << "\" does not have "
+              "an audio stream" );
+  AVPacket flush;
+  if ( packet == NULL ) {
+    av_init_packet( &flush );
+    flush.data = NULL;
+    flush.size = 0;
+    packet = &flush;
+  };
+  int frameFinished = 0;
+  int len = avcodec_decode_audio4( m_audioDec, m_aFrame, &frameFinished, packet );
+  ERRORMACRO( len >= 0, Error, ,
+              "Error decoding audio frame of file \"" << m_mrl << "\"" );
+  // A packet can contain several audio frames. Skip the decoded part.
+  if ( packet->data != NULL ) {
+    packet->data += len;
+    packet->size -= len;
+  };
+  return frameFinished ? m_aFrame : NULL;
+}
+
+AVStream *AVInput::videoStream(void) const
+{
+  return m_videoStream != -1 ? m_ic->streams[ m_videoStream ] : NULL;
+}
+
+AVStream *AVInput::audioStream(void) const
+{
+  return m_audioStream != -1 ? m_ic->streams[ m_audioStream ] : NULL;
+}
+
 VALUE AVInput::registerRubyClass( VALUE rbModule )
 {
   cRubyClass = rb_define_class_under( rbModule, "AVInput", rb_cObject );
   rb_define_singleton_method( cRubyClass, "new",
-                              RUBY_METHOD_FUNC( wrapNew ), 2 );
+                              RUBY_METHOD_FUNC( wrapNew ), 6 );
   rb_define_const( cRubyClass, "AV_TIME_BASE", INT2NUM( AV_TIME_BASE ) );
   rb_define_const( cRubyClass, "AV_NOPTS_VALUE", LL2NUM( AV_NOPTS_VALUE ) );
   rb_define_method( cRubyClass, "close", RUBY_METHOD_FUNC( wrapClose ), 0 );
@@ -346,24 +822,81 @@ VALUE AVInput::registerRubyClass( VALUE rbModule )
   rb_define_method( cRubyClass, "has_audio?", RUBY_METHOD_FUNC( wrapHasAudio ), 0 );
   rb_define_method( cRubyClass, "has_video?", RUBY_METHOD_FUNC( wrapHasVideo ), 0 );
   rb_define_method( cRubyClass, "seek", RUBY_METHOD_FUNC( wrapSeek ), 1 );
+  rb_define_method( cRubyClass, "cache_size=",
+                    RUBY_METHOD_FUNC( wrapSetCacheSize ), 1 );
+  rb_define_method( cRubyClass, "cache_size", RUBY_METHOD_FUNC( wrapCacheSize ), 0 );
+  rb_define_method( cRubyClass, "frame_cache=",
+                    RUBY_METHOD_FUNC( wrapSetFrameCache ), 1 );
   rb_define_method( cRubyClass, "video_pts", RUBY_METHOD_FUNC( wrapVideoPTS ), 0 );
   rb_define_method( cRubyClass, "audio_pts", RUBY_METHOD_FUNC( wrapAudioPTS ), 0 );
+  rb_define_method( cRubyClass, "latency", RUBY_METHOD_FUNC( wrapLatency ), 0 );
+  rb_define_method( cRubyClass, "picture_type",
+                    RUBY_METHOD_FUNC( wrapPictureType ), 0 );
+  rb_define_method( cRubyClass, "motion_vector_data",
+                    RUBY_METHOD_FUNC( wrapMotionVectors ), 0 );
+  rb_define_method( cRubyClass, "qp_data", RUBY_METHOD_FUNC( wrapQPTable ), 0 );
+  rb_define_method( cRubyClass, "qp_stride", RUBY_METHOD_FUNC( wrapQPStride ), 0 );
   return cRubyClass;
 }
 
+void AVInput::markRubyMembers(void)
+{
+  if ( m_videoFrame.get() ) m_videoFrame->markRubyMember();
+  if ( m_audioFrame.get() ) m_audioFrame->markRubyMember();
+  if ( m_motionVectors.get() ) m_motionVectors->markRubyMember();
+  if ( m_qpTable.get() ) m_qpTable->markRubyMember();
+  for ( map< long long, CacheEntry >::iterator i = m_cache.begin();
+        i != m_cache.end(); i++ ) {
+    i->second.frame->markRubyMember();
+    if ( i->second.motionVectors.get() ) i->second.motionVectors->markRubyMember();
+    if ( i->second.qpTable.get() ) i->second.qpTable->markRubyMember();
+  };
+  rb_gc_mark( m_rbFrameCache );
+}
+
+void AVInput::markRubyObject( void *ptr )
+{
+  (*(AVInputPtr *)ptr)->markRubyMembers();
+}
+
 void AVInput::deleteRubyObject( void *ptr )
 {
   delete (AVInputPtr *)ptr;
 }
 
-VALUE AVInput::wrapNew( VALUE rbClass, VALUE rbMRL, VALUE rbAudio )
+size_t AVInput::memorySizeRubyObject( const void *ptr )
+{
+  return (*(AVInputPtr *)ptr)->memorySize();
+}
+
+size_t AVInput::frameMemorySize( AVFrame *frame )
+{
+  size_t retVal = 0;
+  if ( frame != NULL )
+    for ( int i=0; i<AV_NUM_DATA_POINTERS; i++ )
+      if ( frame->buf[i] != NULL ) retVal += frame->buf[i]->size;
+  return retVal;
+}
+
+size_t AVInput::memorySize(void)
+{
+  // Decoded frames held by the decoder. Frames passed to Ruby are accounted for
+  // separately.
+  return sizeof( AVInput ) + frameMemorySize( m_vFrame ) +
+         frameMemorySize( m_aFrame );
+}
+
+VALUE AVInput::wrapNew( VALUE rbClass, VALUE rbMRL, VALUE rbAudio, VALUE rbGray,
+                        VALUE rbLive, VALUE rbMaxLatency, VALUE rbMotionVectors )
 {
   VALUE retVal = Qnil;
   try {
     rb_check_type( rbMRL, T_STRING );
-    AVInputPtr ptr( new AVInput( StringValuePtr( rbMRL ), rbAudio == Qtrue ) );
-    retVal = Data_Wrap_Struct( rbClass, 0, deleteRubyObject,
-                               new AVInputPtr( ptr ) );
+    AVInputPtr ptr( new AVInput( StringValuePtr( rbMRL ), rbAudio == Qtrue,
+                                 rbGray == Qtrue, rbLive == Qtrue,
+                                 NUM2DBL( rbMaxLatency ),
+                                 rbMotionVectors == Qtrue ) );
+    retVal = TypedData_Wrap_Struct( rbClass, &dataType, new AVInputPtr( ptr ) );
   } catch ( exception &e ) {
     rb_raise( rb_eRuntimeError, "%s", e.what() );
   };
@@ -372,14 +905,16 @@ VALUE AVInput::wrapNew( VALUE rbClass, VALUE rbMRL, VALUE rbAudio )
 
 VALUE AVInput::wrapClose( VALUE rbSelf )
 {
-  AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+  AVInputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
   (*self)->close();
   return rbSelf;
 }
 
 VALUE AVInput::wrapReadAV( VALUE rbSelf )
 {
-  AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+  AVInputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
   return (*self)->wrapReadAVInst();
 }
 
@@ -402,7 +937,8 @@ VALUE AVInput::wrapReadAVInst(void)
 
 VALUE AVInput::wrapStatus( VALUE rbSelf )
 {
-  AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+  AVInputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
   return (*self)->status() ? Qtrue : Qfalse;
 }
 
@@ -410,7 +946,8 @@ VALUE AVInput::wrapVideoTimeBase( VALUE rbSelf )
 {
   VALUE retVal = Qnil;
   try {
-    AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+    AVInputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
     AVRational videoTimeBase = (*self)->videoTimeBase();
     retVal = rb_funcall( rb_cObject, rb_intern( "Rational" ), 2,
                          INT2NUM( videoTimeBase.num ), INT2NUM( videoTimeBase.den ) );
@@ -424,7 +961,8 @@ VALUE AVInput::wrapAudioTimeBase( VALUE rbSelf )
 {
   VALUE retVal = Qnil;
   try {
-    AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+    AVInputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
     AVRational audioTimeBase = (*self)->audioTimeBase();
     retVal = rb_funcall( rb_cObject, rb_intern( "Rational" ), 2,
                          INT2NUM( audioTimeBase.num ), INT2NUM( audioTimeBase.den ) );
@@ -438,7 +976,8 @@ VALUE AVInput::wrapFrameRate( VALUE rbSelf )
 {
   VALUE retVal = Qnil;
   try {
-    AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+    AVInputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
     AVRational frameRate = (*self)->frameRate();
     retVal = rb_funcall( rb_cObject, rb_intern( "Rational" ), 2,
                          INT2NUM( frameRate.num ), INT2NUM( frameRate.den ) );
@@ -452,7 +991,8 @@ VALUE AVInput::wrapAspectRatio( VALUE rbSelf )
 {
   VALUE retVal = Qnil;
   try {
-    AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+    AVInputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
     AVRational aspectRatio = (*self)->aspectRatio();
     retVal = rb_funcall( rb_cObject, rb_intern( "Rational" ), 2,
                          INT2NUM( aspectRatio.num ), INT2NUM( aspectRatio.den ) );
@@ -466,7 +1006,8 @@ VALUE AVInput::wrapSampleRate( VALUE rbSelf )
 {
   VALUE retVal = Qnil;
   try {
-    AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+    AVInputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
     retVal = INT2NUM( (*self)->sampleRate() );
   } catch ( exception &e ) {
     rb_raise( rb_eRuntimeError, "%s", e.what() );
@@ -478,7 +1019,8 @@ VALUE AVInput::wrapChannels( VALUE rbSelf )
 {
   VALUE retVal = Qnil;
   try {
-    AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+    AVInputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
     retVal = INT2NUM( (*self)->channels() );
   } catch ( exception &e ) {
     rb_raise( rb_eRuntimeError, "%s", e.what() );
@@ -490,7 +1032,8 @@ VALUE AVInput::wrapDuration( VALUE rbSelf )
 {
   VALUE retVal = Qnil;
   try {
-    AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+    AVInputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
     retVal = LL2NUM( (*self)->duration() );
   } catch ( exception &e ) {
     rb_raise( rb_eRuntimeError, "%s", e.what() );
@@ -502,7 +1045,8 @@ VALUE AVInput::wrapVideoStartTime( VALUE rbSelf )
 {
   VALUE retVal = Qnil;
   try {
-    AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+    AVInputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
     retVal = LL2NUM( (*self)->videoStartTime() );
   } catch ( exception &e ) {
     rb_raise( rb_eRuntimeError, "%s", e.what() );
@@ -514,7 +1058,8 @@ VALUE AVInput::wrapAudioStartTime( VALUE rbSelf )
 {
   VALUE retVal = Qnil;
   try {
-    AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+    AVInputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
     retVal = LL2NUM( (*self)->audioStartTime() );
   } catch ( exception &e ) {
     rb_raise( rb_eRuntimeError, "%s", e.what() );
@@ -526,7 +1071,8 @@ VALUE AVInput::wrapWidth( VALUE rbSelf )
 {
   VALUE retVal = Qnil;
   try {
-    AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+    AVInputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
     retVal = INT2NUM( (*self)->width() );
   } catch ( exception &e ) {
     rb_raise( rb_eRuntimeError, "%s", e.what() );
@@ -538,7 +1084,8 @@ VALUE AVInput::wrapHeight( VALUE rbSelf )
 {
   VALUE retVal = Qnil;
   try {
-    AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+    AVInputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
     retVal = INT2NUM( (*self)->height() );
   } catch ( exception &e ) {
     rb_raise( rb_eRuntimeError, "%s", e.what() );
@@ -548,13 +1095,15 @@ VALUE AVInput::wrapHeight( VALUE rbSelf )
 
 VALUE AVInput::wrapHasVideo( VALUE rbSelf )
 {
-  AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+  AVInputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
   return (*self)->hasVideo() ? Qtrue : Qfalse;
 }
 
 VALUE AVInput::wrapHasAudio( VALUE rbSelf )
 {
-  AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+  AVInputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
   return (*self)->hasAudio() ? Qtrue : Qfalse;
 }
 
@@ -562,19 +1111,52 @@ VALUE AVInput::wrapSeek( VALUE rbSelf, VALUE rbPos )
 {
   VALUE retVal = Qnil;
   try {
-    AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
-    (*self)->seek( NUM2LL( rbPos ) );
+    AVInputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
+    // Frames in the cache are served without seeking in the file.
+    if ( !(*self)->seekCache( NUM2LL( rbPos ) ) ) (*self)->seek( NUM2LL( rbPos ) );
   } catch ( exception &e ) {
     rb_raise( rb_eRuntimeError, "%s", e.what() );
   };
   return retVal;
 }
 
+VALUE AVInput::wrapSetCacheSize( VALUE rbSelf, VALUE rbCacheSize )
+{
+  AVInputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
+  (*self)->setCacheSize( NUM2ULL( rbCacheSize ) );
+  return rbCacheSize;
+}
+
+VALUE AVInput::wrapCacheSize( VALUE rbSelf )
+{
+  AVInputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
+  return ULL2NUM( (*self)->cacheSize() );
+}
+
+VALUE AVInput::wrapSetFrameCache( VALUE rbSelf, VALUE rbFrameCache )
+{
+  try {
+    AVInputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
+    FrameCachePtr *frameCache;
+    TypedData_Get_Struct( rbFrameCache, FrameCachePtr, &FrameCache::dataType,
+                          frameCache );
+    (*self)->setFrameCache( *frameCache, rbFrameCache );
+  } catch ( exception &e ) {
+    rb_raise( rb_eRuntimeError, "%s", e.what() );
+  };
+  return rbFrameCache;
+}
+
 VALUE AVInput::wrapVideoPTS( VALUE rbSelf )
 {
   VALUE retVal = Qnil;
   try {
-    AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+    AVInputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
     retVal = LL2NUM( (*self)->videoPts() );
   } catch ( exception &e ) {
     rb_raise( rb_eRuntimeError, "%s", e.what() );
@@ -586,7 +1168,8 @@ VALUE AVInput::wrapAudioPTS( VALUE rbSelf )
 {
   VALUE retVal = Qnil;
   try {
-    AVInputPtr *self; Data_Get_Struct( rbSelf, AVInputPtr, self );
+    AVInputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
     retVal = LL2NUM( (*self)->audioPts() );
   } catch ( exception &e ) {
     rb_raise( rb_eRuntimeError, "%s", e.what() );
@@ -594,3 +1177,41 @@ VALUE AVInput::wrapAudioPTS( VALUE rbSelf )
   return retVal;
 }
 
+VALUE AVInput::wrapLatency( VALUE rbSelf )
+{
+  AVInputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
+  return rb_float_new( (*self)->latency() );
+}
+
+VALUE AVInput::wrapPictureType( VALUE rbSelf )
+{
+  AVInputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
+  char pictureType = (*self)->pictureType();
+  return rb_str_new( &pictureType, 1 );
+}
+
+VALUE AVInput::wrapMotionVectors( VALUE rbSelf )
+{
+  AVInputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
+  SequencePtr motionVectors = (*self)->motionVectors();
+  return motionVectors.get() ? motionVectors->rubyObject() : Qnil;
+}
+
+VALUE AVInput::wrapQPTable( VALUE rbSelf )
+{
+  AVInputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
+  SequencePtr qpTable = (*self)->qpTable();
+  return qpTable.get() ? qpTable->rubyObject() : Qnil;
+}
+
+VALUE AVInput::wrapQPStride( VALUE rbSelf )
+{
+  AVInputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVInputPtr, &AVInput::dataType, self );
+  return INT2NUM( (*self)->qpStride() );
+}
+
@@ -20,6 +20,8 @@
 #include "config.h"
 #endif
 
+#include <list>
+#include <map>
 #include <boost/shared_ptr.hpp>
 extern "C" {
 #ifndef HAVE_LIBSWSCALE_INCDIR
@@ -38,10 +40,16 @@ extern "C" {
 #include "frame.hh"
 #include "sequence.hh"
 
+class FrameCache;
+
+typedef boost::shared_ptr< FrameCache > FrameCachePtr;
+
 class AVInput
 {
 public:
-  AVInput( const std::string &mrl, bool audio = true ) throw (Error);
+  AVInput( const std::string &mrl, bool audio = true, bool gray = false,
+           bool live = false, double maxLatency = 0.5,
+           bool motionVectors = false ) throw (Error);
   virtual ~AVInput(void);
   void close(void);
   void readAV(void) throw (Error);
@@ -59,13 +67,38 @@ public:
   long long duration(void) throw (Error);
   long long videoStartTime(void) throw (Error);
   long long audioStartTime(void) throw (Error);
-  void seek( long long timestamp ) throw (Error);
+  void seek( long long timestamp, bool backward = false ) throw (Error);
+  void setCacheSize( size_t cacheSize );
+  size_t cacheSize(void) const { return m_cacheSize; }
+  bool seekCache( long long timestamp ) throw (Error);
+  void setFrameCache( FrameCachePtr frameCache, VALUE rbFrameCache ) throw (Error);
+  FramePtr videoFrame(void) const { return m_videoFrame; }
+  bool eof(void) const { return m_eof; }
   long long videoPts(void) throw (Error);
   long long audioPts(void) throw (Error);
+  double latency(void) const;
+  char pictureType(void) const;
+  SequencePtr motionVectors(void) const;
+  SequencePtr qpTable(void) const;
+  int qpStride(void) const;
+  void fastDecode( int width, int height ) throw (Error);
+  AVFrame *decodeKeyFrame( long long timestamp ) throw (Error);
+  bool readPacket( AVPacket *packet ) throw (Error);
+  AVFrame *decodeVideo( AVPacket *packet ) throw (Error);
+  AVFrame *decodeAudio( AVPacket *packet ) throw (Error);
+  AVStream *videoStream(void) const;
+  AVStream *audioStream(void) const;
   static VALUE cRubyClass;
   static VALUE registerRubyClass( VALUE rbModule );
+  void markRubyMembers(void);
+  static void markRubyObject( void *ptr );
   static void deleteRubyObject( void *ptr );
-  static VALUE wrapNew( VALUE rbClass, VALUE rbMRL, VALUE rbAudio );
+  static size_t memorySizeRubyObject( const void *ptr );
+  static size_t frameMemorySize( AVFrame *frame );
+  static const rb_data_type_t dataType;
+  size_t memorySize(void);
+  static VALUE wrapNew( VALUE rbClass, VALUE rbMRL, VALUE rbAudio, VALUE rbGray,
+                        VALUE rbLive, VALUE rbMaxLatency, VALUE rbMotionVectors );
   static VALUE wrapClose( VALUE rbSelf );
   static VALUE wrapReadAV( VALUE rbSelf );
   VALUE wrapReadAVInst(void);
@@ -84,9 +117,42 @@ public:
   static VALUE wrapHasVideo( VALUE rbSelf );
   static VALUE wrapHasAudio( VALUE rbSelf );
   static VALUE wrapSeek( VALUE rbSelf, VALUE rbPos );
+  static VALUE wrapSetCacheSize( VALUE rbSelf, VALUE rbCacheSize );
+  static VALUE wrapCacheSize( VALUE rbSelf );
+  static VALUE wrapSetFrameCache( VALUE rbSelf, VALUE rbFrameCache );
   static VALUE wrapVideoPTS( VALUE rbSelf );
   static VALUE wrapAudioPTS( VALUE rbSelf );
+  static VALUE wrapLatency( VALUE rbSelf );
+  static VALUE wrapPictureType( VALUE rbSelf );
+  static VALUE wrapMotionVectors( VALUE rbSelf );
+  static VALUE wrapQPTable( VALUE rbSelf );
+  static VALUE wrapQPStride( VALUE rbSelf );
 protected:
+  struct CacheEntry {
+    // Memory held by the frame and its exported side data.
+    int storageSize(void) const {
+      return frame->storageSize() +
+        ( motionVectors.get() ? motionVectors->size() : 0 ) +
+        ( qpTable.get() ? qpTable->size() : 0 );
+    }
+    FramePtr frame;
+    SequencePtr motionVectors;
+    SequencePtr qpTable;
+    int qpStride;
+    char pictureType;
+    long long prev;
+    long long next;
+    std::list< long long >::iterator lru;
+  };
+  void decodeAV(void) throw (Error);
+  bool readCache(void);
+  void cacheFrame(void);
+  void evictCache(void);
+  void clearCache(void);
+  void convertVideo(void) throw (Error);
+  void exportSideData(void);
+  bool updateLatency( const AVPacket &packet );
+  static bool lumaPlanar( enum AVPixelFormat pixFmt );
   std::string m_mrl;
   AVFormatContext *m_ic;
   AVCodecContext *m_videoDec;
@@ -95,6 +161,15 @@ protected:
   AVCodec *m_audioCodec;
   int m_videoStream;
   int m_audioStream;
+  bool m_gray;
+  bool m_live;
+  long long m_maxLatency;
+  long long m_latency;
+  long long m_wallStart;
+  long long m_ptsStart;
+  bool m_exportMotionVectors;
+  char m_pictureType;
+  int m_qpStride;
   long long m_videoPts;
   long long m_audioPts;
   struct SwsContext *m_swsContext;
@@ -102,6 +177,21 @@ protected:
   AVFrame *m_aFrame;
   FramePtr m_videoFrame;
   SequencePtr m_audioFrame;
+  SequencePtr m_motionVectors;
+  SequencePtr m_qpTable;
+  std::map< long long, CacheEntry > m_cache;
+  std::list< long long > m_cacheLRU;
+  size_t m_cacheSize;
+  size_t m_cacheBytes;
+  long long m_cursor;
+  long long m_served;
+  long long m_resync;
+  long long m_seekTarget;
+  long long m_lastDecoded;
+  bool m_eof;
+  FrameCachePtr m_frameCache;
+  VALUE m_rbFrameCache;
+  int m_frameCacheIndex;
 };
 
 typedef boost::shared_ptr< AVInput > AVInputPtr;
@@ -14,11 +14,17 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <boost/bind.hpp>
 #ifndef NDEBUG
 #include <iostream>
 #endif
 extern "C" {
+  #include <libavutil/imgutils.h>
   #include <libavutil/mathematics.h>
+  #include <libavutil/pixdesc.h>
+  #include <libavutil/time.h>
 }
 #include "avoutput.hh"
 
@@ -26,43 +32,73 @@ extern "C" {
 #define INT64_C(c) c ## LL
 #endif
 
-#define VIDEO_BUF_SIZE ( 16 * FF_MIN_BUFFER_SIZE )
-#define AUDIO_BUF_SIZE ( 2 * FF_MIN_BUFFER_SIZE )
-
 using namespace std;
 
 VALUE AVOutput::cRubyClass = Qnil;
 
+const rb_data_type_t AVOutput::dataType = {
+  "Hornetseye::AVOutput",
+  { markRubyObject, deleteRubyObject, memorySizeRubyObject, 0, { 0 } },
+  0, 0, 0
+};
+
 AVOutput::AVOutput( const string &mrl, int videoBitRate, int width, int height,
                     int timeBaseNum, int timeBaseDen, int aspectRatioNum,
                     int aspectRatioDen, enum AVCodecID videoCodec,
                     int audioBitRate, int sampleRate, int channels,
-                    enum AVCodecID audioCodec ) throw (Error):
-  m_mrl( mrl ), m_oc( NULL ), m_videoStream( NULL ), m_audioStream( NULL),
-  m_videoCodecOpen( false ), m_audioCodecOpen( false ), m_videoBuf( NULL ),
-  m_audioBuf( NULL ), m_fileOpen( false ), m_headerWritten( false ),
-  m_swsContext( NULL ), m_frame( NULL )
+                    enum AVCodecID audioCodec,
+                    const map< string, string > &options, int sink )
+  throw (Error):
+  m_name( mrl ), m_open( false ), m_mrl( mrl ), m_oc( NULL ), m_videoStream( NULL ),
+  m_audioStream( NULL), m_videoIndex( -1 ), m_audioIndex( -1 ),
+  m_videoEnc( NULL ), m_audioEnc( NULL ), m_sink( sink ), m_fileOpen( false ),
+  m_headerWritten( false ), m_swsContext( NULL ), m_frame( NULL ),
+  m_audioFrame( NULL ), m_packet( NULL ), m_audioFifo( NULL ),
+  m_audioFrameSize( 0 ), m_inputSampleRate( 0 ), m_swrContext( NULL ),
+  m_swrFormat( AV_SAMPLE_FMT_NONE ), m_swrSampleRate( 0 ), m_swrChannels( 0 ),
+  m_convertData( NULL ), m_convertSize( 0 ),
+  m_videoPts( 0 ), m_audioPts( 0 ),
+  m_copyOffset( AV_NOPTS_VALUE ), m_async( false ), m_dropFrames( false ),
+  m_droppedFrames( 0 ), m_latencyBudget( 0 ), m_startTime( AV_NOPTS_VALUE ),
+  m_duplicatedFrames( 0 ), m_lastFrame( NULL ), m_encoding( AV_NOPTS_VALUE ),
+  m_maxLatency( 0 ), m_videoPool( NULL ), m_zeroCopy( false ), m_dataPos( 0 ),
+  m_segmentTime( 0 ), m_segmentSize( 0 ), m_segmentStart( AV_NOPTS_VALUE ),
+  m_segmentIndex( 0 ), m_formatOptions( NULL )
 {
+  AVDictionary *videoOptions = NULL, *audioOptions = NULL, *formatOptions = NULL;
   try {
-    AVOutputFormat *format;
-    av_register_all();
-    format = av_guess_format( NULL, mrl.c_str(), NULL );
-    if ( format == NULL ) format = av_guess_format( "mpeg", NULL, NULL );
-    ERRORMACRO( format != NULL, Error, ,
-                "Could not find suitable output format for \"" << mrl << "\""  );
-    m_oc = avformat_alloc_context();
-    ERRORMACRO( m_oc != NULL, Error, , "Failure allocating format context" );
-    m_oc->oformat = format;
-    snprintf( m_oc->filename, sizeof( m_oc->filename ), "%s", mrl.c_str() );
+    // The same encoder options are offered to both encoders.
+    for ( map< string, string >::const_iterator i = options.begin();
+          i != options.end(); i++ )
+      if ( i->first == "segment_time" )
+        m_segmentTime = (long long)( atof( i->second.c_str() ) * AV_TIME_BASE );
+      else if ( i->first == "segment_size" )
+        m_segmentSize = atoll( i->second.c_str() );
+      else
+        av_dict_set( &videoOptions, i->first.c_str(), i->second.c_str(), 0 );
+    av_dict_copy( &audioOptions, videoOptions, 0 );
+    if ( m_segmentTime > 0 || m_segmentSize > 0 ) {
+      // The file name is a pattern such as "record%05d.mp4".
+      ERRORMACRO( sink == FILE_SINK, Error, , "Segmenting requires file output" );
+      m_segmentPattern = mrl;
+      m_mrl = segmentName( 0 );
+    };
+    m_oc = allocContext( m_mrl );
+    AVOutputFormat *format = m_oc->oformat;
     ERRORMACRO( format->video_codec != AV_CODEC_ID_NONE, Error, ,
                 "Output format does not support video" );
     m_videoStream = avformat_new_stream( m_oc, NULL );
     ERRORMACRO( m_videoStream != NULL, Error, , "Could not allocate video stream" );
     m_videoStream->sample_aspect_ratio.num = aspectRatioNum;
     m_videoStream->sample_aspect_ratio.den = aspectRatioDen;
-    AVCodecContext *c = m_videoStream->codec;
-    c->codec_id = videoCodec != AV_CODEC_ID_NONE ? videoCodec : format->video_codec;
-    c->codec_type = AVMEDIA_TYPE_VIDEO;
+    enum AVCodecID videoCodecId =
+      videoCodec != AV_CODEC_ID_NONE ? videoCodec : format->video_codec;
+    AVCodec *codec = avcodec_find_encoder( videoCodecId );
+    ERRORMACRO( codec != NULL, Error, , "Could not find video codec "
+                << videoCodecId );
+    m_videoEnc = avcodec_alloc_context3( codec );
+    ERRORMACRO( m_videoEnc != NULL, Error, , "Error allocating video encoder" );
+    AVCodecContext *c = m_videoEnc;
     c->bit_rate = videoBitRate;
     c->width = width;
     c->height = height;
@@ -74,60 +110,90 @@ AVOutput::AVOutput( const string &mrl, int videoBitRate, int width, int height,
     c->sample_aspect_ratio.den = aspectRatioDen;
     if ( m_oc->oformat->flags & AVFMT_GLOBALHEADER )
       c->flags |= CODEC_FLAG_GLOBAL_HEADER;
+    ERRORMACRO( avcodec_open2( c, codec, &videoOptions ) >= 0, Error, ,
+                "Error opening video codec \"" << codec->name << "\": "
+                << strerror( errno ) );
+    ERRORMACRO( avcodec_parameters_from_context( m_videoStream->codecpar, c ) >= 0,
+                Error, , "Error setting video stream parameters" );
+    m_videoStream->time_base = c->time_base;
+    m_videoIndex = m_videoStream->index;
     if ( channels > 0 ) {
       m_audioStream = avformat_new_stream( m_oc, NULL );
       ERRORMACRO( m_audioStream != NULL, Error, , "Could not allocate audio stream" );
-      AVCodecContext *c = m_audioStream->codec;
-      c->codec_id = audioCodec != AV_CODEC_ID_NONE ? audioCodec : format->audio_codec;
-      c->codec_type = AVMEDIA_TYPE_AUDIO;
+      enum AVCodecID audioCodecId =
+        audioCodec != AV_CODEC_ID_NONE ? audioCodec : format->audio_codec;
+      AVCodec *codec = avcodec_find_encoder( audioCodecId );
+      ERRORMACRO( codec != NULL, Error, , "Could not find audio codec "
+                  << audioCodecId );
+      m_audioEnc = avcodec_alloc_context3( codec );
+      ERRORMACRO( m_audioEnc != NULL, Error, , "Error allocating audio encoder" );
+      AVCodecContext *c = m_audioEnc;
       c->bit_rate = audioBitRate;
+      // Samples are resampled if the encoder does not support the input rate.
+      m_inputSampleRate = sampleRate;
       c->sample_rate = sampleRate;
+      if ( codec->supported_samplerates ) {
+        const int *rate = codec->supported_samplerates;
+        c->sample_rate = *rate;
+        while ( *rate != 0 && *rate != sampleRate ) {
+          if ( *rate > c->sample_rate ? c->sample_rate < sampleRate :
+               *rate >= sampleRate )
+            c->sample_rate = *rate;
+          rate++;
+        };
+        if ( *rate != 0 ) c->sample_rate = sampleRate;
+      };
       c->channels = channels;
+      c->channel_layout = av_get_default_channel_layout( channels );
+      // Use 16-bit samples unless the encoder requires another sample format.
+      c->sample_fmt = AV_SAMPLE_FMT_S16;
+      if ( codec->sample_fmts ) {
+        const enum AVSampleFormat *fmt = codec->sample_fmts;
+        while ( *fmt != AV_SAMPLE_FMT_NONE && *fmt != AV_SAMPLE_FMT_S16 ) fmt++;
+        if ( *fmt == AV_SAMPLE_FMT_NONE ) c->sample_fmt = codec->sample_fmts[0];
+      };
+      c->time_base.num = 1;
+      c->time_base.den = c->sample_rate;
       if ( m_oc->oformat->flags & AVFMT_GLOBALHEADER )
         c->flags |= CODEC_FLAG_GLOBAL_HEADER;
-    };
-    // ERRORMACRO( av_set_parameters( m_oc, NULL ) >= 0, Error, ,
-    //             "Invalid output format parameters: " << strerror( errno ) );
-    AVCodec *codec = avcodec_find_encoder( c->codec_id );
-    ERRORMACRO( codec != NULL, Error, , "Could not find video codec "
-                << c->codec_id );
-    ERRORMACRO( avcodec_open2( c, codec, NULL ) >= 0, Error, ,
-                "Error opening video codec \"" << codec->name << "\": "
-                << strerror( errno ) );
-    m_videoCodecOpen = true;
-    if ( !( m_oc->oformat->flags & AVFMT_RAWPICTURE ) ) {
-      m_videoBuf = (char *)av_malloc( VIDEO_BUF_SIZE );
-      ERRORMACRO( m_videoBuf != NULL, Error, ,
-                  "Error allocating video output buffer" );
-    };
-    if ( channels > 0 ) {
-      AVCodecContext *c = m_audioStream->codec;
-      AVCodec *codec = avcodec_find_encoder( c->codec_id );
-      ERRORMACRO( codec != NULL, Error, , "Could not find audio codec "
-                  << c->codec_id );
-      ERRORMACRO( avcodec_open2( c, codec, NULL ) >= 0, Error, ,
+      ERRORMACRO( avcodec_open2( c, codec, &audioOptions ) >= 0, Error, ,
                   "Error opening audio codec \"" << codec->name << "\": "
                   << strerror( errno ) );
-      m_audioCodecOpen = true;
-      m_audioBuf = (char *)av_malloc( AUDIO_BUF_SIZE );
-      ERRORMACRO( m_audioBuf != NULL, Error, ,
-                  "Error allocating audio output buffer" );
+      ERRORMACRO( avcodec_parameters_from_context( m_audioStream->codecpar, c ) >= 0,
+                  Error, , "Error setting audio stream parameters" );
+      m_audioStream->time_base = c->time_base;
+      m_audioIndex = m_audioStream->index;
+      // Encoders accepting any frame size get blocks of 1024 samples.
+      m_audioFrameSize = c->frame_size > 0 ? c->frame_size : 1024;
+      m_audioFifo = av_audio_fifo_alloc( c->sample_fmt, c->channels,
+                                         m_audioFrameSize );
+      ERRORMACRO( m_audioFifo != NULL, Error, , "Error allocating audio FIFO" );
+      m_audioFrame = allocAudioFrame();
 #ifndef NDEBUG
       cerr << "audio frame size = " << c->frame_size << " samples" << endl;
 #endif
     };
-    if ( !( format->flags & AVFMT_NOFILE ) ) {
-      ERRORMACRO(avio_open(&m_oc->pb, mrl.c_str(), AVIO_FLAG_WRITE) >= 0, Error, ,
-                 "Could not open \"" << mrl << "\"" );
-      m_fileOpen = true;
-    };
-    ERRORMACRO( avformat_write_header(m_oc, NULL) >= 0, Error, ,
-                "Error writing header of video \"" << mrl << "\": "
-                << strerror( errno ) );
-    m_headerWritten = true;
-    m_swsContext = sws_getContext( width, height, AV_PIX_FMT_YUV420P,
-                                   width, height, AV_PIX_FMT_YUV420P,
-                                   SWS_FAST_BILINEAR, 0, 0, 0 );
+    // Options not recognised by any encoder are passed on to the muxer
+    // (e.g. "movflags").
+    AVDictionaryEntry *unused = NULL;
+    while ( ( unused = av_dict_get( videoOptions, "", unused,
+                                    AV_DICT_IGNORE_SUFFIX ) ) != NULL )
+      if ( m_audioEnc == NULL ||
+           av_dict_get( audioOptions, unused->key, NULL, 0 ) != NULL )
+        av_dict_set( &formatOptions, unused->key, unused->value, 0 );
+    av_dict_free( &videoOptions );
+    av_dict_free( &audioOptions );
+    // The packet structure is reused, the encoder allocates the payload.
+    m_packet = av_packet_alloc();
+    ERRORMACRO( m_packet, Error, , "Error allocating packet" );
+    // Every segment is opened with the same format options.
+    av_dict_copy( &m_formatOptions, formatOptions, 0 );
+    openFile( &formatOptions );
+    m_open = true;
+    unused = av_dict_get( formatOptions, "", NULL, AV_DICT_IGNORE_SUFFIX );
+    ERRORMACRO( unused == NULL, Error, , "Unknown encoder or format option \""
+                << unused->key << "\"" );
+    av_dict_free( &formatOptions );
     m_frame = av_frame_alloc();
     ERRORMACRO( m_frame, Error, , "Error allocating frame" );
     int size = avpicture_get_size( AV_PIX_FMT_YUV420P, width, height );
@@ -135,185 +201,1100 @@ AVOutput::AVOutput( const string &mrl, int videoBitRate, int width, int height,
     ERRORMACRO( frameBuffer, Error, , "Error allocating memory buffer for frame" );
     avpicture_fill( (AVPicture *)m_frame, (uint8_t *)frameBuffer, AV_PIX_FMT_YUV420P,
                     width, height );
+    m_frame->format = AV_PIX_FMT_YUV420P;
+    m_frame->width = width;
+    m_frame->height = height;
   } catch ( Error &e ) {
+    av_dict_free( &videoOptions );
+    av_dict_free( &audioOptions );
+    av_dict_free( &formatOptions );
     close();
     throw e;
   };
 }
 
+AVOutput::AVOutput( const string &mrl, AVInputPtr input ) throw (Error):
+  m_name( mrl ), m_open( false ), m_mrl( mrl ), m_oc( NULL ), m_videoStream( NULL ),
+  m_audioStream( NULL), m_videoIndex( -1 ), m_audioIndex( -1 ),
+  m_videoEnc( NULL ), m_audioEnc( NULL ), m_sink( FILE_SINK ), m_fileOpen( false ),
+  m_headerWritten( false ), m_swsContext( NULL ), m_frame( NULL ),
+  m_audioFrame( NULL ), m_packet( NULL ), m_audioFifo( NULL ),
+  m_audioFrameSize( 0 ), m_inputSampleRate( 0 ), m_swrContext( NULL ),
+  m_swrFormat( AV_SAMPLE_FMT_NONE ), m_swrSampleRate( 0 ), m_swrChannels( 0 ),
+  m_convertData( NULL ), m_convertSize( 0 ),
+  m_videoPts( 0 ), m_audioPts( 0 ),
+  m_copyOffset( AV_NOPTS_VALUE ), m_async( false ), m_dropFrames( false ),
+  m_droppedFrames( 0 ), m_latencyBudget( 0 ), m_startTime( AV_NOPTS_VALUE ),
+  m_duplicatedFrames( 0 ), m_lastFrame( NULL ), m_encoding( AV_NOPTS_VALUE ),
+  m_maxLatency( 0 ), m_videoPool( NULL ), m_zeroCopy( false ), m_dataPos( 0 ),
+  m_segmentTime( 0 ), m_segmentSize( 0 ), m_segmentStart( AV_NOPTS_VALUE ),
+  m_segmentIndex( 0 ), m_formatOptions( NULL )
+{
+  try {
+    m_oc = allocContext( m_mrl );
+    // Stream copy: codec parameters are taken over without opening encoders.
+    if ( input->videoStream() != NULL )
+      m_videoStream = copyStream( input->videoStream() );
+    if ( input->audioStream() != NULL )
+      m_audioStream = copyStream( input->audioStream() );
+    ERRORMACRO( m_videoStream != NULL || m_audioStream != NULL, Error, ,
+                "Input does not have any video or audio stream to copy" );
+    openFile();
+    m_open = true;
+  } catch ( Error &e ) {
+    close();
+    throw e;
+  };
+}
+
+AVOutputFormat *AVOutput::guessFormat( const string &mrl ) throw (Error)
+{
+  AVOutputFormat *retVal;
+  av_register_all();
+  retVal = av_guess_format( NULL, mrl.c_str(), NULL );
+  if ( retVal == NULL ) retVal = av_guess_format( "mpeg", NULL, NULL );
+  ERRORMACRO( retVal != NULL, Error, ,
+              "Could not find suitable output format for \"" << mrl << "\""  );
+  return retVal;
+}
+
+AVFormatContext *AVOutput::allocContext( const string &mrl ) throw (Error)
+{
+  AVOutputFormat *format = guessFormat( mrl );
+  AVFormatContext *retVal = avformat_alloc_context();
+  ERRORMACRO( retVal != NULL, Error, , "Failure allocating format context" );
+  retVal->oformat = format;
+  snprintf( retVal->filename, sizeof( retVal->filename ), "%s", mrl.c_str() );
+  return retVal;
+}
+
+AVStream *AVOutput::copyStream( AVStream *source ) throw (Error)
+{
+  AVStream *retVal = avformat_new_stream( m_oc, NULL );
+  ERRORMACRO( retVal != NULL, Error, , "Could not allocate stream" );
+  ERRORMACRO( avcodec_parameters_copy( retVal->codecpar, source->codecpar ) >= 0,
+              Error, , "Error copying codec parameters" );
+  // The codec tag of the input container may not be valid for the output.
+  retVal->codecpar->codec_tag = 0;
+  retVal->time_base = source->time_base;
+  retVal->sample_aspect_ratio = source->sample_aspect_ratio;
+  return retVal;
+}
+
+void AVOutput::openFile( AVDictionary **options ) throw (Error)
+{
+  if ( m_sink != FILE_SINK ) {
+    // Write to memory. A stream sink is drained while writing and cannot seek.
+    int size = 65536;
+    unsigned char *buffer = (unsigned char *)av_malloc( size );
+    ERRORMACRO( buffer != NULL, Error, , "Error allocating I/O buffer" );
+    m_oc->pb = avio_alloc_context( buffer, size, 1, this, NULL, writeData,
+                                   m_sink == MEMORY_SINK ? seekData : NULL );
+    if ( m_oc->pb == NULL ) {
+      av_free( buffer );
+      ERRORMACRO( false, Error, , "Error allocating I/O context" );
+    };
+    m_oc->flags |= AVFMT_FLAG_CUSTOM_IO;
+    m_fileOpen = true;
+  } else if ( !( m_oc->oformat->flags & AVFMT_NOFILE ) ) {
+    ERRORMACRO(avio_open(&m_oc->pb, m_mrl.c_str(), AVIO_FLAG_WRITE) >= 0, Error, ,
+               "Could not open \"" << m_mrl << "\"" );
+    m_fileOpen = true;
+  };
+  ERRORMACRO( avformat_write_header( m_oc, options ) >= 0, Error, ,
+              "Error writing header of video \"" << m_mrl << "\": "
+              << strerror( errno ) );
+  m_headerWritten = true;
+}
+
+int AVOutput::writeData( void *opaque, uint8_t *buf, int size )
+{
+  AVOutput *self = (AVOutput *)opaque;
+  boost::mutex::scoped_lock lock( self->m_dataMutex );
+  if ( self->m_sink == STREAM_SINK )
+    self->m_data.append( (const char *)buf, size );
+  else {
+    // The muxer may seek back to update headers.
+    if ( self->m_dataPos + size > self->m_data.size() )
+      self->m_data.resize( self->m_dataPos + size );
+    self->m_data.replace( self->m_dataPos, size, (const char *)buf, size );
+    self->m_dataPos += size;
+  };
+  return size;
+}
+
+int64_t AVOutput::seekData( void *opaque, int64_t offset, int whence )
+{
+  AVOutput *self = (AVOutput *)opaque;
+  boost::mutex::scoped_lock lock( self->m_dataMutex );
+  switch ( whence & ~AVSEEK_FORCE ) {
+  case AVSEEK_SIZE:
+    return self->m_data.size();
+  case SEEK_SET:
+    break;
+  case SEEK_CUR:
+    offset += self->m_dataPos;
+    break;
+  case SEEK_END:
+    offset += self->m_data.size();
+    break;
+  default:
+    return -1;
+  };
+  if ( offset < 0 ) return -1;
+  self->m_dataPos = offset;
+  return offset;
+}
+
+string AVOutput::data(void)
+{
+  boost::mutex::scoped_lock lock( m_dataMutex );
+  return m_data;
+}
+
+string AVOutput::takeData( int minSize )
+{
+  // Data is handed out in large chunks to reduce the number of IO calls.
+  boost::mutex::scoped_lock lock( m_dataMutex );
+  string retVal;
+  if ( (int)m_data.size() >= minSize ) retVal.swap( m_data );
+  return retVal;
+}
+
 AVOutput::~AVOutput(void)
 {
-  close();
+  close( true );
 }
 
-void AVOutput::close(void)
+void AVOutput::close( bool collected ) throw (Error)
 {
+  m_open = false;
+  stopThreads();
+  if ( m_headerWritten ) {
+    bool drain;
+    {
+      // Frames borrowed from Ruby may have been collected in the same run of
+      // the garbage collector.
+      boost::mutex::scoped_lock lock( m_pinnedMutex );
+      drain = !collected || m_pinned.empty();
+    }
+    try {
+      if ( m_audioEnc ) flushAudio();
+      // Drain frames delayed by lookahead, B-frames or frame threading.
+      if ( m_videoEnc && drain ) encode( m_videoEnc, NULL );
+      if ( m_audioEnc ) encode( m_audioEnc, NULL );
+    } catch ( Error &e ) {
+      boost::mutex::scoped_lock lock( m_errorMutex );
+      if ( m_threadError.empty() ) m_threadError = e.what();
+    };
+    av_write_trailer( m_oc );
+    m_headerWritten = false;
+    if ( !m_segmentPattern.empty() ) {
+      boost::mutex::scoped_lock lock( m_segmentMutex );
+      m_segments.push_back( m_mrl );
+    };
+  };
+  av_dict_free( &m_formatOptions );
   if ( m_frame ) {
     if ( m_frame->data[0] )
       av_free( m_frame->data[0] );
     av_free( m_frame );
     m_frame = NULL;
   };
+  if ( m_audioFrame ) {
+    av_frame_free( &m_audioFrame );
+    m_audioFrame = NULL;
+  };
+  if ( m_swrContext ) {
+    swr_free( &m_swrContext );
+    m_swrContext = NULL;
+  };
+  if ( m_convertData ) {
+    av_freep( &m_convertData[0] );
+    av_freep( &m_convertData );
+    m_convertSize = 0;
+  };
+  if ( m_audioFifo ) {
+    av_audio_fifo_free( m_audioFifo );
+    m_audioFifo = NULL;
+  };
+  if ( m_packet ) {
+    av_packet_free( &m_packet );
+    m_packet = NULL;
+  };
+  for ( vector< AVPacket * >::iterator i = m_packetPool.begin();
+        i != m_packetPool.end(); i++ )
+    av_packet_free( &*i );
+  m_packetPool.clear();
   if ( m_swsContext ) {
     sws_freeContext( m_swsContext );
     m_swsContext = NULL;
   };
-  if ( m_headerWritten ) {
-    av_write_trailer( m_oc );
-    m_headerWritten = false;
-  };
-  if ( m_audioStream ) {
-    if ( m_audioCodecOpen ) {
-      avcodec_close( m_audioStream->codec );
-      m_audioCodecOpen = false;
-    };
-  };
-  if ( m_videoStream ) {
-    if ( m_videoCodecOpen ) {
-      avcodec_close( m_videoStream->codec );
-      m_videoCodecOpen = false;
-    };
+  if ( m_videoPool ) {
+    // Buffers still referenced by frames keep the pool alive until released.
+    av_buffer_pool_uninit( &m_videoPool );
+    m_videoPool = NULL;
   };
-  if ( m_audioBuf ) {
-    av_free( m_audioBuf );
-    m_audioBuf = NULL;
+  if ( m_audioEnc ) {
+    avcodec_free_context( &m_audioEnc );
+    m_audioEnc = NULL;
   };
-  if ( m_videoBuf ) {
-    av_free( m_videoBuf );
-    m_videoBuf = NULL;
+  if ( m_videoEnc ) {
+    avcodec_free_context( &m_videoEnc );
+    m_videoEnc = NULL;
   };
   if ( m_oc ) {
-    for ( unsigned int i = 0; i < m_oc->nb_streams; i++ ) {
-      av_freep( &m_oc->streams[i]->codec );
-      av_freep( &m_oc->streams[i] );
-    };
     m_audioStream = NULL;
     m_videoStream = NULL;
     if ( m_fileOpen ) {
-      avio_close(m_oc->pb);
+      if ( m_sink != FILE_SINK ) {
+        avio_flush( m_oc->pb );
+        av_freep( &m_oc->pb->buffer );
+        avio_context_free( &m_oc->pb );
+      } else
+        avio_close(m_oc->pb);
       m_fileOpen = false;
     };
-    av_free( m_oc );
+    avformat_free_context( m_oc );
     m_oc = NULL;
   };
+  // Errors of the encoding and muxing threads are reported once the file is
+  // closed. The garbage collector cannot report them.
+  string error;
+  {
+    boost::mutex::scoped_lock lock( m_errorMutex );
+    error.swap( m_threadError );
+  }
+#ifndef NDEBUG
+  if ( collected && !error.empty() ) cerr << error << endl;
+#endif
+  ERRORMACRO( collected || error.empty(), Error, , error );
 }
 
 AVRational AVOutput::videoTimeBase(void) throw (Error)
 {
-  ERRORMACRO( m_videoStream != NULL, Error, , "Video \"" << m_mrl << "\" is not open. "
+  // The streams are replaced by the mux thread when starting a new segment.
+  boost::mutex::scoped_lock lock( m_containerMutex );
+  ERRORMACRO( m_videoStream != NULL, Error, , "Video \"" << m_name << "\" is not open. "
               "Did you call \"close\" before?" );
   return m_videoStream->time_base;
 }
 
 AVRational AVOutput::audioTimeBase(void) throw (Error)
 {
-  ERRORMACRO( m_audioStream != NULL, Error, , "Audio \"" << m_mrl << "\" is not open. "
+  boost::mutex::scoped_lock lock( m_containerMutex );
+  ERRORMACRO( m_audioStream != NULL, Error, , "Audio \"" << m_name << "\" is not open. "
               "Did you call \"close\" before?" );
   return m_audioStream->time_base;
 }
 
+int AVOutput::width(void) throw (Error)
+{
+  ERRORMACRO( m_videoEnc != NULL, Error, , "Video \"" << m_name << "\" does not have "
+              "a video encoder" );
+  return m_videoEnc->width;
+}
+
+int AVOutput::height(void) throw (Error)
+{
+  ERRORMACRO( m_videoEnc != NULL, Error, , "Video \"" << m_name << "\" does not have "
+              "a video encoder" );
+  return m_videoEnc->height;
+}
+
 int AVOutput::frameSize(void) throw (Error)
 {
-  ERRORMACRO( m_oc != NULL, Error, , "Video \"" << m_mrl << "\" is not open. "
+  ERRORMACRO( m_open, Error, , "Video \"" << m_name << "\" is not open. "
               "Did you call \"close\" before?" );
-  ERRORMACRO( m_audioStream != NULL, Error, , "Video \"" << m_mrl << "\" does not have "
-              "an audio stream" );
-  return m_audioStream->codec->frame_size;
+  ERRORMACRO( m_audioEnc != NULL, Error, , "Video \"" << m_name << "\" does not have "
+              "an audio encoder" );
+  return m_audioFrameSize;
 }
 
 int AVOutput::channels(void) throw (Error)
 {
-  ERRORMACRO( m_oc != NULL, Error, , "Video \"" << m_mrl << "\" is not open. "
+  ERRORMACRO( m_open, Error, , "Video \"" << m_name << "\" is not open. "
+              "Did you call \"close\" before?" );
+  ERRORMACRO( m_audioEnc != NULL, Error, , "Video \"" << m_name << "\" does not have "
+              "an audio encoder" );
+  return m_audioEnc->channels;
+}
+
+void AVOutput::writeVideo( FramePtr frame, long long time ) throw (Error)
+{
+  ERRORMACRO( m_open, Error, , "Video \"" << m_name << "\" is not open. "
               "Did you call \"close\" before?" );
-  ERRORMACRO( m_audioStream != NULL, Error, , "Video \"" << m_mrl << "\" does not have "
-              "an audio stream" );
-  return m_audioStream->codec->channels;
+  ERRORMACRO( m_videoEnc != NULL, Error, , "Video \"" << m_name << "\" does not have "
+              "a video encoder" );
+  AVFrame picture;
+  frameLayout( frame, &picture );
+  if ( zeroCopyPossible( &picture ) ) {
+    long long pts = nextVideoPts( time );
+    if ( pts == AV_NOPTS_VALUE ) return;
+    AVFrame *target = wrapFrame( frame, &picture );
+    target->pts = pts;
+    try {
+      encode( m_videoEnc, target );
+    } catch ( Error &e ) {
+      av_frame_free( &target );
+      throw e;
+    };
+    av_frame_free( &target );
+  } else
+    writeVideo( &picture, time );
 }
 
-void AVOutput::writeVideo( FramePtr frame ) throw (Error)
+void AVOutput::writeVideo( AVFrame *picture, long long time ) throw (Error)
 {
-  ERRORMACRO( m_oc != NULL, Error, , "Video \"" << m_mrl << "\" is not open. "
+  ERRORMACRO( m_open, Error, , "Video \"" << m_name << "\" is not open. "
               "Did you call \"close\" before?" );
-  ERRORMACRO( m_videoStream->codec->width == frame->width() &&
-              m_videoStream->codec->height == frame->height(), Error, ,
-              "Resolution of frame is " << frame->width() << 'x'
-              << frame->height() << " but video resolution is "
-              << m_videoStream->codec->width << 'x' << m_videoStream->codec->height );
-  if ( m_oc->oformat->flags & AVFMT_RAWPICTURE ) {
-    ERRORMACRO( false, Error, , "Raw picture encoding not implemented yet" );
+  ERRORMACRO( m_videoEnc != NULL, Error, , "Video \"" << m_name << "\" does not have "
+              "a video encoder" );
+  AVCodecContext *c = m_videoEnc;
+  // Frames shed in real-time mode are not even converted.
+  long long pts = nextVideoPts( time );
+  if ( pts == AV_NOPTS_VALUE ) return;
+  // Colour conversion and scaling to the output resolution are done in one pass.
+  m_swsContext = sws_getCachedContext( m_swsContext, picture->width, picture->height,
+                                       (enum AVPixelFormat)picture->format,
+                                       c->width, c->height, c->pix_fmt,
+                                       SWS_FAST_BILINEAR, 0, 0, 0 );
+  ERRORMACRO( m_swsContext != NULL, Error, , "Error creating scaling context for "
+              << av_get_pix_fmt_name( (enum AVPixelFormat)picture->format )
+              << " frame of size " << picture->width << 'x' << picture->height );
+  // In asynchronous mode the frame is copied so that the caller can reuse it.
+  AVFrame *target = m_async ? allocVideoFrame() : m_frame;
+  sws_scale( m_swsContext, picture->data, picture->linesize, 0,
+             picture->height, target->data, target->linesize );
+  target->pts = pts;
+  submit( target, true );
+}
+
+void AVOutput::writeScaledVideo( AVFrame *frame, long long time ) throw (Error)
+{
+  ERRORMACRO( m_open, Error, , "Video \"" << m_name << "\" is not open. "
+              "Did you call \"close\" before?" );
+  ERRORMACRO( m_videoEnc != NULL, Error, , "Video \"" << m_name << "\" does not have "
+              "a video encoder" );
+  AVCodecContext *c = m_videoEnc;
+  ERRORMACRO( frame->format == c->pix_fmt && frame->width == c->width &&
+              frame->height == c->height, Error, , "Frame does not match pixel "
+              "format and resolution of video \"" << m_name << "\"" );
+  long long pts = nextVideoPts( time );
+  if ( pts == AV_NOPTS_VALUE ) return;
+  // The caller keeps its reference to the frame.
+  AVFrame *target = av_frame_clone( frame );
+  ERRORMACRO( target != NULL, Error, , "Error referencing frame" );
+  target->pts = pts;
+  try {
+    submit( target, true );
+  } catch ( Error &e ) {
+    av_frame_free( &target );
+    throw e;
+  };
+  if ( !m_async ) av_frame_free( &target );
+}
+
+long long AVOutput::nextVideoPts( long long time ) throw (Error)
+{
+  bool realtime = m_latencyBudget > 0;
+  if ( realtime ) {
+    // Frames without a timestamp are placed according to the wall clock.
+    long long now = av_gettime_relative();
+    if ( m_startTime == AV_NOPTS_VALUE ) m_startTime = now;
+    if ( time == AV_NOPTS_VALUE ) time = now - m_startTime;
+  };
+  long long retVal = m_videoPts;
+  if ( time != AV_NOPTS_VALUE ) {
+    // Timestamps given by the caller may leave gaps but must increase strictly.
+    retVal = av_rescale_q( time, AV_TIME_BASE_Q, m_videoEnc->time_base );
+    if ( retVal < m_videoPts ) {
+      // In real-time mode frames arriving faster than the frame rate are dropped.
+      if ( realtime ) {
+        m_droppedFrames++;
+        return AV_NOPTS_VALUE;
+      };
+      retVal = m_videoPts;
+    };
+  };
+  if ( realtime && latency() > m_latencyBudget ) {
+    // The slot of a frame shed because of encoder lag is not filled.
+    m_videoPts = retVal + 1;
+    m_droppedFrames++;
+    return AV_NOPTS_VALUE;
+  };
+  if ( realtime && m_lastFrame != NULL ) {
+    // Missed frame slots are filled with the previous frame while the encoder
+    // keeps up.
+    while ( m_videoPts < retVal ) {
+      AVFrame *duplicate = av_frame_clone( m_lastFrame );
+      ERRORMACRO( duplicate != NULL, Error, , "Error referencing frame" );
+      duplicate->pts = m_videoPts;
+      EncodeItem item;
+      item.frame = duplicate;
+      item.video = true;
+      item.queued = av_gettime_relative();
+      if ( !m_encodeQueue->tryPush( item ) ) {
+        av_frame_free( &duplicate );
+        break;
+      };
+      m_duplicatedFrames++;
+      m_videoPts++;
+    };
+  };
+  m_videoPts = retVal + 1;
+  return retVal;
+}
+
+size_t AVOutput::memorySize(void)
+{
+  // Frame buffers, buffered samples and encoded data not taken yet.
+  size_t retVal = sizeof( AVOutput ) + AVInput::frameMemorySize( m_frame ) +
+                  AVInput::frameMemorySize( m_audioFrame );
+  if ( m_audioFifo != NULL )
+    retVal += av_audio_fifo_size( m_audioFifo ) * m_audioEnc->channels *
+              av_get_bytes_per_sample( m_audioEnc->sample_fmt );
+  boost::mutex::scoped_lock lock( m_dataMutex );
+  return retVal + m_data.capacity();
+}
+
+bool AVOutput::zeroCopyPossible( AVFrame *picture )
+{
+  AVCodecContext *c = m_videoEnc;
+  if ( !m_zeroCopy || m_async ) return false;
+  if ( picture->format != c->pix_fmt ||
+       picture->width != c->width || picture->height != c->height )
+    return false;
+  for ( int i=0; i<AV_NUM_DATA_POINTERS && picture->data[i]; i++ )
+    if ( ( (uintptr_t)picture->data[i] & 0x7 ) || ( picture->linesize[i] & 0x7 ) )
+      return false;
+  return true;
+}
+
+AVFrame *AVOutput::wrapFrame( FramePtr frame, AVFrame *picture ) throw (Error)
+{
+  AVFrame *retVal = av_frame_alloc();
+  ERRORMACRO( retVal != NULL, Error, , "Error allocating frame" );
+  uint8_t *data = (uint8_t *)frame->data();
+  // The Ruby object is kept alive until the encoder releases the buffer.
+  retVal->buf[0] = av_buffer_create( data, frame->storageSize(),
+                                     releaseFrame, this, AV_BUFFER_FLAG_READONLY );
+  if ( retVal->buf[0] == NULL ) {
+    av_frame_free( &retVal );
+    ERRORMACRO( false, Error, , "Error referencing frame memory" );
+  };
+  {
+    boost::mutex::scoped_lock lock( m_pinnedMutex );
+    m_pinned.insert( make_pair( data, frame->rubyObject() ) );
+  }
+  memcpy( retVal->data, picture->data, sizeof( retVal->data ) );
+  memcpy( retVal->linesize, picture->linesize, sizeof( retVal->linesize ) );
+  retVal->format = picture->format;
+  retVal->width = picture->width;
+  retVal->height = picture->height;
+  return retVal;
+}
+
+void AVOutput::releaseFrame( void *opaque, uint8_t *data )
+{
+  // Called by the encoder, possibly from one of its threads.
+  AVOutput *self = (AVOutput *)opaque;
+  boost::mutex::scoped_lock lock( self->m_pinnedMutex );
+  multimap< uint8_t *, VALUE >::iterator i = self->m_pinned.find( data );
+  if ( i != self->m_pinned.end() ) self->m_pinned.erase( i );
+}
+
+void AVOutput::frameLayout( FramePtr frame, AVFrame *picture ) throw (Error)
+{
+  string typecode = frame->typecode();
+  int
+    width   = frame->width(),
+    height  = frame->height();
+  uint8_t *data = (uint8_t *)frame->data();
+  memset( picture->data, 0, sizeof( picture->data ) );
+  memset( picture->linesize, 0, sizeof( picture->linesize ) );
+  picture->width = width;
+  picture->height = height;
+  if ( typecode == "YV12" || typecode == "I420" ) {
+    picture->format = AV_PIX_FMT_YUV420P;
+    for ( int i=0; i<3; i++ ) {
+      picture->data[i] = (uint8_t *)frame->plane( i );
+      picture->linesize[i] = frame->lineSize( i );
+    };
   } else {
-    AVCodecContext *c = m_videoStream->codec;
-    AVFrame picture;
-    int
-      width   = c->width,
-      height  = c->height,
-      width2  = ( width  + 1 ) / 2,
-      height2 = ( height + 1 ) / 2,
-      widtha  = ( width  + 7 ) & ~0x7,
-      width2a = ( width2 + 7 ) & ~0x7;
-    picture.data[0] = (uint8_t *)frame->data();
-    picture.data[2] = (uint8_t *)frame->data() + widtha * height;
-    picture.data[1] = (uint8_t *)picture.data[2] + width2a * height2;
-    picture.linesize[0] = widtha;
-    picture.linesize[1] = width2a;
-    picture.linesize[2] = width2a;
-    sws_scale( m_swsContext, picture.data, picture.linesize, 0,
-               c->height, m_frame->data, m_frame->linesize );
-    int packetSize = avcodec_encode_video( c, (uint8_t *)m_videoBuf,
-                                           VIDEO_BUF_SIZE, m_frame );
-    ERRORMACRO( packetSize >= 0, Error, , "Error encoding video frame" );
-    if ( packetSize > 0 ) {
-      AVPacket packet;
-      av_init_packet( &packet );
-      if ( c->coded_frame->pts != AV_NOPTS_VALUE )
-        packet.pts = av_rescale_q( c->coded_frame->pts, c->time_base,
-                                   m_videoStream->time_base );
-      if ( c->coded_frame->key_frame )
-        packet.flags |= AV_PKT_FLAG_KEY;
-      packet.stream_index = m_videoStream->index;
-      packet.data = (uint8_t *)m_videoBuf;
-      packet.size = packetSize;
-      ERRORMACRO( av_interleaved_write_frame( m_oc, &packet ) >= 0, Error, ,
-                  "Error writing video frame of video \"" << m_mrl << "\": "
-                  << strerror( errno ) );
+    if ( typecode == "UBYTE" ) {
+      picture->format = AV_PIX_FMT_GRAY8;
+    } else if ( typecode == "UBYTERGB" ) {
+      picture->format = AV_PIX_FMT_RGB24;
+    } else {
+      if ( typecode == "YUY2" )
+        picture->format = AV_PIX_FMT_YUYV422;
+      else if ( typecode == "UYVY" )
+        picture->format = AV_PIX_FMT_UYVY422;
+      else if ( typecode == "RGB" || typecode == "RGB24" )
+        picture->format = AV_PIX_FMT_RGB24;
+      else if ( typecode == "BGR" )
+        picture->format = AV_PIX_FMT_BGR24;
+      else if ( typecode == "BGRA" )
+        picture->format = AV_PIX_FMT_BGRA;
+      else
+        ERRORMACRO( false, Error, , "Frames of type " << typecode << " are not "
+                    "supported by the video encoder" );
     };
+    // Packed frames may have padded lines.
+    picture->linesize[0] = frame->lineSize( 0 );
+    picture->data[0] = data;
   };
 }
 
-void AVOutput::writeAudio( SequencePtr frame ) throw (Error)
+void AVOutput::writeAudio( SequencePtr frame, enum AVSampleFormat format,
+                           long long time ) throw (Error)
 {
-  ERRORMACRO( m_oc != NULL, Error, , "Video \"" << m_mrl << "\" is not open. "
+  ERRORMACRO( m_open, Error, , "Video \"" << m_name << "\" is not open. "
               "Did you call \"close\" before?" );
-  ERRORMACRO( m_audioStream != NULL, Error, , "Video \"" << m_mrl << "\" does not have "
-              "an audio stream" );
-  AVCodecContext *c = m_audioStream->codec;
-  ERRORMACRO( frame->size() == c->frame_size * 2 * c->channels, Error, , "Size of "
-              "audio frame is " << frame->size() << " bytes (but should be "
-              << c->frame_size * 2 * c->channels << " bytes)" );
-  int packetSize = avcodec_encode_audio( c, (uint8_t *)m_audioBuf,
-                                         AUDIO_BUF_SIZE, (short *)frame->data() );
-  ERRORMACRO( packetSize >= 0, Error, , "Error encoding audio frame" );
-  if ( packetSize > 0 ) {
-    AVPacket packet;
-    av_init_packet( &packet );
-    if ( c->coded_frame && c->coded_frame->pts != AV_NOPTS_VALUE )
-      packet.pts = av_rescale_q( c->coded_frame->pts, c->time_base,
-                                 m_audioStream->time_base );
-    packet.flags |= AV_PKT_FLAG_KEY;
-    packet.stream_index = m_audioStream->index;
-    packet.data = (uint8_t *)m_audioBuf;
-    packet.size = packetSize;
-    ERRORMACRO( av_interleaved_write_frame( m_oc, &packet ) >= 0, Error, ,
-                "Error writing audio frame of video \"" << m_mrl << "\": "
+  ERRORMACRO( m_audioEnc != NULL, Error, , "Video \"" << m_name << "\" does not have "
+              "an audio encoder" );
+  AVCodecContext *c = m_audioEnc;
+  int bytesPerSample = av_get_bytes_per_sample( format ) * c->channels;
+  ERRORMACRO( frame->size() % bytesPerSample == 0, Error, , "Size of audio "
+              "frame is " << frame->size() << " bytes (but should be a multiple of "
+              << bytesPerSample << " bytes)" );
+  if ( time != AV_NOPTS_VALUE ) audioGap( time );
+  const uint8_t *data = (const uint8_t *)frame->data();
+  bufferAudio( &data, frame->size() / bytesPerSample, format, m_inputSampleRate,
+               c->channels );
+}
+
+void AVOutput::writeAudio( AVFrame *frame, long long time ) throw (Error)
+{
+  ERRORMACRO( m_open, Error, , "Video \"" << m_name << "\" is not open. "
+              "Did you call \"close\" before?" );
+  ERRORMACRO( m_audioEnc != NULL, Error, , "Video \"" << m_name << "\" does not have "
+              "an audio encoder" );
+  if ( time != AV_NOPTS_VALUE ) audioGap( time );
+  bufferAudio( (const uint8_t **)frame->extended_data, frame->nb_samples,
+               (enum AVSampleFormat)frame->format, frame->sample_rate,
+               frame->channels );
+}
+
+void AVOutput::bufferAudio( const uint8_t **data, int samples,
+                            enum AVSampleFormat format, int sampleRate,
+                            int channels ) throw (Error)
+{
+  AVCodecContext *c = m_audioEnc;
+  if ( format == c->sample_fmt && sampleRate == c->sample_rate &&
+       channels == c->channels ) {
+    ERRORMACRO( av_audio_fifo_write( m_audioFifo, (void **)data, samples ) >= 0,
+                Error, , "Error buffering audio samples" );
+  } else {
+    if ( m_swrContext == NULL || format != m_swrFormat ||
+         sampleRate != m_swrSampleRate || channels != m_swrChannels ) {
+      if ( m_swrContext ) swr_free( &m_swrContext );
+      m_swrContext = swr_alloc_set_opts( NULL, c->channel_layout, c->sample_fmt,
+                                         c->sample_rate,
+                                         av_get_default_channel_layout( channels ),
+                                         format, sampleRate, 0, NULL );
+      ERRORMACRO( m_swrContext != NULL && swr_init( m_swrContext ) >= 0, Error, ,
+                  "Error initialising audio conversion from "
+                  << av_get_sample_fmt_name( format ) << " to "
+                  << av_get_sample_fmt_name( c->sample_fmt ) );
+      m_swrFormat = format;
+      m_swrSampleRate = sampleRate;
+      m_swrChannels = channels;
+    };
+    convertAudio( data, samples );
+  };
+  while ( av_audio_fifo_size( m_audioFifo ) >= m_audioFrameSize )
+    encodeAudio( m_audioFrameSize );
+}
+
+void AVOutput::audioGap( long long time ) throw (Error)
+{
+  AVCodecContext *c = m_audioEnc;
+  int buffered = av_audio_fifo_size( m_audioFifo );
+  long long gap = av_rescale_q( time, AV_TIME_BASE_Q, c->time_base ) -
+    ( m_audioPts + buffered );
+  // Overlapping samples are appended without moving them.
+  if ( gap <= 0 ) return;
+  // Only the pending frame is completed with silence. The rest of the gap is
+  // skipped by advancing the timestamp.
+  int pad = (int)min( gap, (long long)( ( m_audioFrameSize -
+                                          buffered % m_audioFrameSize ) %
+                                        m_audioFrameSize ) );
+  if ( pad > 0 ) {
+    uint8_t **silence;
+    ERRORMACRO( av_samples_alloc_array_and_samples( &silence, NULL, c->channels,
+                                                    pad, c->sample_fmt, 0 ) >= 0,
+                Error, , "Error allocating audio buffer" );
+    av_samples_set_silence( silence, 0, pad, c->channels, c->sample_fmt );
+    int err = av_audio_fifo_write( m_audioFifo, (void **)silence, pad );
+    av_freep( &silence[0] );
+    av_freep( &silence );
+    ERRORMACRO( err >= 0, Error, , "Error buffering audio samples" );
+    while ( av_audio_fifo_size( m_audioFifo ) >= m_audioFrameSize )
+      encodeAudio( m_audioFrameSize );
+  };
+  if ( av_audio_fifo_size( m_audioFifo ) == 0 ) m_audioPts += gap - pad;
+}
+
+void AVOutput::flushAudio(void) throw (Error)
+{
+  // Samples delayed by the resampler come out when passing no input.
+  if ( m_swrContext ) convertAudio( NULL, 0 );
+  while ( av_audio_fifo_size( m_audioFifo ) > 0 )
+    encodeAudio( min( av_audio_fifo_size( m_audioFifo ), m_audioFrameSize ) );
+}
+
+void AVOutput::convertAudio( const uint8_t **data, int samples ) throw (Error)
+{
+  AVCodecContext *c = m_audioEnc;
+  int size = swr_get_out_samples( m_swrContext, samples );
+  if ( size > m_convertSize ) {
+    if ( m_convertData ) {
+      av_freep( &m_convertData[0] );
+      av_freep( &m_convertData );
+    };
+    m_convertSize = 0;
+    ERRORMACRO( av_samples_alloc_array_and_samples( &m_convertData, NULL,
+                                                    c->channels, size,
+                                                    c->sample_fmt, 0 ) >= 0,
+                Error, , "Error allocating audio conversion buffer" );
+    m_convertSize = size;
+  };
+  int converted = swr_convert( m_swrContext, m_convertData, m_convertSize,
+                               data, samples );
+  ERRORMACRO( converted >= 0, Error, , "Error converting audio samples" );
+  ERRORMACRO( av_audio_fifo_write( m_audioFifo, (void **)m_convertData,
+                                   converted ) >= 0,
+              Error, , "Error buffering audio samples" );
+}
+
+void AVOutput::encodeAudio( int samples ) throw (Error)
+{
+  AVCodecContext *c = m_audioEnc;
+  AVFrame *target;
+  if ( m_async )
+    target = allocAudioFrame();
+  else {
+    // The encoder may still hold a reference to the previous frame.
+    target = m_audioFrame;
+    ERRORMACRO( av_frame_make_writable( target ) >= 0, Error, ,
+                "Error allocating audio frame buffer" );
+  };
+  target->nb_samples = m_audioFrameSize;
+  av_audio_fifo_read( m_audioFifo, (void **)target->data, samples );
+  if ( samples < m_audioFrameSize ) {
+    // Only the last frame can be short. Pad it if the encoder requires it.
+    if ( c->codec->capabilities & ( AV_CODEC_CAP_SMALL_LAST_FRAME |
+                                    AV_CODEC_CAP_VARIABLE_FRAME_SIZE ) )
+      target->nb_samples = samples;
+    else
+      av_samples_set_silence( target->data, samples, m_audioFrameSize - samples,
+                              c->channels, c->sample_fmt );
+  };
+  target->pts = m_audioPts;
+  m_audioPts += target->nb_samples;
+  submit( target, false );
+}
+
+void AVOutput::encode( AVCodecContext *c, AVFrame *frame ) throw (Error)
+{
+  ERRORMACRO( avcodec_send_frame( c, frame ) >= 0, Error, ,
+              "Error encoding frame of video \"" << m_name << "\"" );
+  // An encoder can return any number of packets for one frame. Timestamps stay
+  // in the time base of the encoder until the packet is muxed.
+  int err;
+  while ( ( err = avcodec_receive_packet( c, m_packet ) ) >= 0 ) {
+    m_packet->stream_index = c == m_videoEnc ? m_videoIndex : m_audioIndex;
+    writePacket( m_packet );
+  };
+  ERRORMACRO( err == AVERROR( EAGAIN ) || err == AVERROR_EOF, Error, ,
+              "Error encoding frame of video \"" << m_name << "\"" );
+}
+
+void AVOutput::submit( AVFrame *frame, bool video ) throw (Error)
+{
+  if ( m_async ) {
+    checkThreadError();
+    EncodeItem item;
+    item.frame = frame;
+    item.video = video;
+    item.queued = av_gettime_relative();
+    if ( m_latencyBudget > 0 && video ) {
+      // Keep a reference for filling missed frame slots.
+      av_frame_free( &m_lastFrame );
+      m_lastFrame = av_frame_clone( frame );
+    };
+    if ( m_dropFrames && video ) {
+      // Dropped frames leave a gap in the timestamps instead of slowing down.
+      if ( !m_encodeQueue->tryPush( item ) ) {
+        av_frame_free( &frame );
+        m_droppedFrames++;
+      };
+    } else
+      m_encodeQueue->push( item );
+  } else
+    encode( video ? m_videoEnc : m_audioEnc, frame );
+}
+
+void AVOutput::writePacket( AVPacket *packet ) throw (Error)
+{
+  if ( m_async ) {
+    AVPacket *queued = allocPacket();
+    av_packet_move_ref( queued, packet );
+    m_packetQueue->push( queued );
+  } else
+    muxPacket( packet );
+}
+
+void AVOutput::muxPacket( AVPacket *packet ) throw (Error)
+{
+  AVCodecContext *c = packet->stream_index == m_videoIndex ? m_videoEnc : m_audioEnc;
+  if ( !m_segmentPattern.empty() && c == m_videoEnc &&
+       ( packet->flags & AV_PKT_FLAG_KEY ) ) {
+    // Start a new file at the first keyframe after reaching a threshold.
+    long long time = av_rescale_q( packet->pts, c->time_base, AV_TIME_BASE_Q );
+    if ( m_segmentStart == AV_NOPTS_VALUE )
+      m_segmentStart = time;
+    else if ( ( m_segmentTime > 0 && time - m_segmentStart >= m_segmentTime ) ||
+              ( m_segmentSize > 0 && avio_tell( m_oc->pb ) >= m_segmentSize ) ) {
+      nextSegment();
+      m_segmentStart = time;
+    };
+  };
+  av_packet_rescale_ts( packet, c->time_base,
+                        m_oc->streams[ packet->stream_index ]->time_base );
+  int err = av_interleaved_write_frame( m_oc, packet );
+  av_packet_unref( packet );
+  ERRORMACRO( err >= 0, Error, , "Error writing frame of video \"" << m_mrl
+              << "\": " << strerror( errno ) );
+}
+
+string AVOutput::segmentName( int index ) throw (Error)
+{
+  char buffer[ 1024 ];
+  ERRORMACRO( av_get_frame_filename( buffer, sizeof( buffer ),
+                                     m_segmentPattern.c_str(), index ) >= 0,
+              Error, , "Segment file name \"" << m_segmentPattern
+              << "\" must contain a number pattern such as %05d" );
+  return buffer;
+}
+
+AVStream *AVOutput::addStream( AVFormatContext *oc, AVCodecContext *c ) throw (Error)
+{
+  AVStream *retVal = avformat_new_stream( oc, NULL );
+  ERRORMACRO( retVal != NULL, Error, , "Could not allocate stream" );
+  ERRORMACRO( avcodec_parameters_from_context( retVal->codecpar, c ) >= 0,
+              Error, , "Error setting stream parameters" );
+  retVal->time_base = c->time_base;
+  retVal->sample_aspect_ratio = c->sample_aspect_ratio;
+  return retVal;
+}
+
+void AVOutput::nextSegment(void) throw (Error)
+{
+  // The encoders keep running, only the container is replaced. The next file is
+  // opened before the current one is closed so that the output stays open.
+  string mrl = segmentName( m_segmentIndex + 1 );
+  AVFormatContext *oc = allocContext( mrl );
+  AVStream *videoStream = NULL, *audioStream = NULL;
+  AVDictionary *options = NULL;
+  try {
+    videoStream = addStream( oc, m_videoEnc );
+    if ( m_audioEnc ) audioStream = addStream( oc, m_audioEnc );
+    if ( !( oc->oformat->flags & AVFMT_NOFILE ) )
+      ERRORMACRO( avio_open( &oc->pb, mrl.c_str(), AVIO_FLAG_WRITE ) >= 0, Error, ,
+                  "Could not open \"" << mrl << "\"" );
+    av_dict_copy( &options, m_formatOptions, 0 );
+    ERRORMACRO( avformat_write_header( oc, &options ) >= 0, Error, ,
+                "Error writing header of video \"" << mrl << "\": "
                 << strerror( errno ) );
+  } catch ( Error &e ) {
+    av_dict_free( &options );
+    if ( oc->pb != NULL ) avio_close( oc->pb );
+    avformat_free_context( oc );
+    throw e;
   };
+  av_dict_free( &options );
+  AVFormatContext *previous = m_oc;
+  string previousMrl = m_mrl;
+  {
+    boost::mutex::scoped_lock lock( m_containerMutex );
+    m_oc = oc;
+    m_mrl = mrl;
+    m_videoStream = videoStream;
+    m_audioStream = audioStream;
+  }
+  m_segmentIndex++;
+  av_write_trailer( previous );
+  if ( previous->pb != NULL ) avio_close( previous->pb );
+  avformat_free_context( previous );
+  {
+    boost::mutex::scoped_lock lock( m_segmentMutex );
+    m_segments.push_back( previousMrl );
+  }
+}
+
+vector< string > AVOutput::segments(void)
+{
+  boost::mutex::scoped_lock lock( m_segmentMutex );
+  return m_segments;
+}
+
+AVPacket *AVOutput::allocPacket(void) throw (Error)
+{
+  {
+    boost::mutex::scoped_lock lock( m_packetPoolMutex );
+    if ( !m_packetPool.empty() ) {
+      AVPacket *retVal = m_packetPool.back();
+      m_packetPool.pop_back();
+      return retVal;
+    };
+  }
+  AVPacket *retVal = av_packet_alloc();
+  ERRORMACRO( retVal != NULL, Error, , "Error allocating packet" );
+  return retVal;
+}
+
+void AVOutput::recyclePacket( AVPacket *packet )
+{
+  av_packet_unref( packet );
+  boost::mutex::scoped_lock lock( m_packetPoolMutex );
+  m_packetPool.push_back( packet );
+}
+
+AVFrame *AVOutput::allocVideoFrame(void) throw (Error)
+{
+  AVCodecContext *c = m_videoEnc;
+  if ( m_videoPool == NULL ) {
+    m_videoPool = av_buffer_pool_init( av_image_get_buffer_size
+                                       ( c->pix_fmt, c->width, c->height, 1 ),
+                                       NULL );
+    ERRORMACRO( m_videoPool != NULL, Error, , "Error allocating frame pool" );
+  };
+  AVFrame *retVal = av_frame_alloc();
+  ERRORMACRO( retVal != NULL, Error, , "Error allocating frame" );
+  retVal->format = c->pix_fmt;
+  retVal->width = c->width;
+  retVal->height = c->height;
+  // Buffers return to the pool once the encoder has released the frame.
+  retVal->buf[0] = av_buffer_pool_get( m_videoPool );
+  if ( retVal->buf[0] == NULL ) {
+    av_frame_free( &retVal );
+    ERRORMACRO( false, Error, , "Error allocating frame buffer" );
+  };
+  av_image_fill_arrays( retVal->data, retVal->linesize, retVal->buf[0]->data,
+                        c->pix_fmt, c->width, c->height, 1 );
+  return retVal;
+}
+
+AVFrame *AVOutput::allocAudioFrame(void) throw (Error)
+{
+  AVCodecContext *c = m_audioEnc;
+  AVFrame *retVal = av_frame_alloc();
+  ERRORMACRO( retVal != NULL, Error, , "Error allocating frame" );
+  retVal->nb_samples = m_audioFrameSize;
+  retVal->format = c->sample_fmt;
+  retVal->channel_layout = c->channel_layout;
+  if ( av_frame_get_buffer( retVal, 0 ) < 0 ) {
+    av_frame_free( &retVal );
+    ERRORMACRO( false, Error, , "Error allocating audio frame buffer" );
+  };
+  return retVal;
+}
+
+void AVOutput::startThreads( int queueSize, bool drop, long long latency )
+  throw (Error)
+{
+  ERRORMACRO( m_open, Error, , "Video \"" << m_name << "\" is not open. "
+              "Did you call \"close\" before?" );
+  ERRORMACRO( m_videoEnc != NULL, Error, , "Video \"" << m_name << "\" does not have "
+              "a video encoder" );
+  ERRORMACRO( !m_async, Error, , "Asynchronous encoding is already running" );
+  // A latency budget sheds load instead of blocking.
+  m_dropFrames = drop || latency > 0;
+  m_latencyBudget = latency;
+  m_startTime = AV_NOPTS_VALUE;
+  m_threadError.clear();
+  m_encodeQueue = boost::shared_ptr< BoundedQueue< EncodeItem > >
+    ( new BoundedQueue< EncodeItem >( queueSize ) );
+  // An encoder can emit several packets per frame.
+  m_packetQueue = boost::shared_ptr< BoundedQueue< AVPacket * > >
+    ( new BoundedQueue< AVPacket * >( 4 * queueSize ) );
+  m_muxThread = boost::shared_ptr< boost::thread >
+    ( new boost::thread( boost::bind( &AVOutput::muxLoop, this ) ) );
+  m_encodeThread = boost::shared_ptr< boost::thread >
+    ( new boost::thread( boost::bind( &AVOutput::encodeLoop, this ) ) );
+  m_async = true;
+}
+
+long long AVOutput::latency(void)
+{
+  // Age of the oldest frame which has not been encoded yet.
+  boost::mutex::scoped_lock lock( m_latencyMutex );
+  return m_encoding == AV_NOPTS_VALUE ? 0 : av_gettime_relative() - m_encoding;
+}
+
+long long AVOutput::maxLatency(void)
+{
+  boost::mutex::scoped_lock lock( m_latencyMutex );
+  return m_maxLatency;
+}
+
+void AVOutput::flush(void) throw (Error)
+{
+  if ( m_async ) {
+    // All packets are queued once the encoder thread has finished its work.
+    m_encodeQueue->waitIdle();
+    m_packetQueue->waitIdle();
+    checkThreadError();
+  };
+}
+
+void AVOutput::stopThreads(void)
+{
+  if ( m_async ) {
+    EncodeItem stop;
+    stop.frame = NULL;
+    stop.video = true;
+    stop.queued = AV_NOPTS_VALUE;
+    m_encodeQueue->push( stop );
+    m_encodeThread->join();
+    m_muxThread->join();
+    m_encodeThread.reset();
+    m_muxThread.reset();
+    m_encodeQueue.reset();
+    m_packetQueue.reset();
+    av_frame_free( &m_lastFrame );
+    m_latencyBudget = 0;
+    m_async = false;
+  };
+}
+
+void AVOutput::checkThreadError(void) throw (Error)
+{
+  boost::mutex::scoped_lock lock( m_errorMutex );
+  ERRORMACRO( m_threadError.empty(), Error, , m_threadError );
+}
+
+void AVOutput::encodeLoop(void)
+{
+  while ( true ) {
+    EncodeItem item = m_encodeQueue->pop();
+    if ( item.frame == NULL ) break;
+    {
+      boost::mutex::scoped_lock lock( m_latencyMutex );
+      m_encoding = item.queued;
+    };
+    try {
+      checkThreadError();
+      if ( item.video )
+        encode( m_videoEnc, item.frame );
+      else
+        encode( m_audioEnc, item.frame );
+    } catch ( exception &e ) {
+      boost::mutex::scoped_lock lock( m_errorMutex );
+      if ( m_threadError.empty() ) m_threadError = e.what();
+    };
+    av_frame_free( &item.frame );
+    {
+      boost::mutex::scoped_lock lock( m_latencyMutex );
+      m_maxLatency = max( m_maxLatency,
+                          (long long)av_gettime_relative() - item.queued );
+      m_encoding = AV_NOPTS_VALUE;
+    };
+    m_encodeQueue->done();
+  };
+  m_packetQueue->push( NULL );
+}
+
+void AVOutput::muxLoop(void)
+{
+  while ( true ) {
+    AVPacket *packet = m_packetQueue->pop();
+    if ( packet == NULL ) break;
+    try {
+      muxPacket( packet );
+    } catch ( exception &e ) {
+      boost::mutex::scoped_lock lock( m_errorMutex );
+      if ( m_threadError.empty() ) m_threadError = e.what();
+    };
+    recyclePacket( packet );
+    m_packetQueue->done();
+  };
+}
+
+bool AVOutput::copyPacket( AVInputPtr input, long long end ) throw (Error)
+{
+  ERRORMACRO( m_open, Error, , "Video \"" << m_name << "\" is not open. "
+              "Did you call \"close\" before?" );
+  ERRORMACRO( m_videoEnc == NULL && m_audioEnc == NULL, Error, ,
+              "Packets can only be copied to \"" << m_name << "\" if it was "
+              "opened with AVOutput.stream_copy" );
+  AVPacket packet;
+  while ( input->readPacket( &packet ) ) {
+    AVStream *source, *target;
+    if ( input->videoStream() != NULL &&
+         packet.stream_index == input->videoStream()->index ) {
+      source = input->videoStream();
+      target = m_videoStream;
+    } else {
+      source = input->audioStream();
+      target = m_audioStream;
+    };
+    long long ts = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+    if ( target == NULL || ts == AV_NOPTS_VALUE ) {
+      av_free_packet( &packet );
+      continue;
+    };
+    long long time = av_rescale_q( ts, source->time_base, AV_TIME_BASE_Q );
+    if ( end != AV_NOPTS_VALUE && time >= end ) {
+      av_free_packet( &packet );
+      return false;
+    };
+    if ( m_copyOffset == AV_NOPTS_VALUE ) {
+      // The clip starts with the first video packet (a keyframe after seeking).
+      if ( target != m_videoStream && m_videoStream != NULL ) {
+        av_free_packet( &packet );
+        continue;
+      };
+      m_copyOffset = time;
+    };
+    if ( time < m_copyOffset ) {
+      av_free_packet( &packet );
+      continue;
+    };
+    long long offset = av_rescale_q( m_copyOffset, AV_TIME_BASE_Q,
+                                     source->time_base );
+    if ( packet.pts != AV_NOPTS_VALUE ) packet.pts -= offset;
+    if ( packet.dts != AV_NOPTS_VALUE ) packet.dts -= offset;
+    av_packet_rescale_ts( &packet, source->time_base, target->time_base );
+    packet.stream_index = target->index;
+    packet.pos = -1;
+    int err = av_interleaved_write_frame( m_oc, &packet );
+    av_free_packet( &packet );
+    ERRORMACRO( err >= 0, Error, , "Error writing packet of video \"" << m_mrl
+                << "\": " << strerror( errno ) );
+    return true;
+  };
+  return false;
+}
+
+void AVOutput::remux( AVInputPtr input, long long start, long long end ) throw (Error)
+{
+  if ( start != AV_NOPTS_VALUE ) input->seek( start, true );
+  while ( copyPacket( input, end ) );
 }
 
 VALUE AVOutput::registerRubyClass( VALUE rbModule )
 {
   cRubyClass = rb_define_class_under( rbModule, "AVOutput", rb_cObject );
   rb_define_singleton_method( cRubyClass, "new",
-                              RUBY_METHOD_FUNC( wrapNew ), 13 );
+                              RUBY_METHOD_FUNC( wrapNew ), 15 );
+  rb_define_singleton_method( cRubyClass, "stream_copy",
+                              RUBY_METHOD_FUNC( wrapStreamCopy ), 2 );
+  rb_define_singleton_method( cRubyClass, "default_video_codec",
+                              RUBY_METHOD_FUNC( wrapDefaultVideoCodec ), 1 );
   rb_define_const( cRubyClass, "AV_CODEC_ID_NONE",
                    INT2FIX( AV_CODEC_ID_NONE ) );
   rb_define_const( cRubyClass, "AV_CODEC_ID_MPEG1VIDEO",
@@ -786,6 +1767,15 @@ VALUE AVOutput::registerRubyClass( VALUE rbModule )
                    INT2FIX( AV_CODEC_ID_SIPR ) );
   rb_define_const( cRubyClass, "AV_CODEC_ID_MP1",
                    INT2FIX( AV_CODEC_ID_MP1 ) );
+  rb_define_const( cRubyClass, "AV_SAMPLE_FMT_S16",
+                   INT2FIX( AV_SAMPLE_FMT_S16 ) );
+  rb_define_const( cRubyClass, "AV_SAMPLE_FMT_S32",
+                   INT2FIX( AV_SAMPLE_FMT_S32 ) );
+  rb_define_const( cRubyClass, "AV_SAMPLE_FMT_FLT",
+                   INT2FIX( AV_SAMPLE_FMT_FLT ) );
+  rb_define_const( cRubyClass, "FILE_SINK", INT2FIX( FILE_SINK ) );
+  rb_define_const( cRubyClass, "MEMORY_SINK", INT2FIX( MEMORY_SINK ) );
+  rb_define_const( cRubyClass, "STREAM_SINK", INT2FIX( STREAM_SINK ) );
   rb_define_method( cRubyClass, "close", RUBY_METHOD_FUNC( wrapClose ), 0 );
   rb_define_method( cRubyClass, "video_time_base",
                     RUBY_METHOD_FUNC( wrapVideoTimeBase ), 0 );
@@ -793,24 +1783,68 @@ VALUE AVOutput::registerRubyClass( VALUE rbModule )
                     RUBY_METHOD_FUNC( wrapAudioTimeBase ), 0 );
   rb_define_method( cRubyClass, "frame_size", RUBY_METHOD_FUNC( wrapFrameSize ), 0 );
   rb_define_method( cRubyClass, "channels", RUBY_METHOD_FUNC( wrapChannels ), 0 );
-  rb_define_method( cRubyClass, "write_video", RUBY_METHOD_FUNC( wrapWriteVideo ), 1 );
-  rb_define_method( cRubyClass, "write_audio", RUBY_METHOD_FUNC( wrapWriteAudio ), 1 );
+  rb_define_method( cRubyClass, "write_video", RUBY_METHOD_FUNC( wrapWriteVideo ), 2 );
+  rb_define_method( cRubyClass, "write_audio", RUBY_METHOD_FUNC( wrapWriteAudio ), 3 );
+  rb_define_method( cRubyClass, "copy_packet", RUBY_METHOD_FUNC( wrapCopyPacket ), 1 );
+  rb_define_method( cRubyClass, "remux", RUBY_METHOD_FUNC( wrapRemux ), 3 );
+  rb_define_method( cRubyClass, "start_threads",
+                    RUBY_METHOD_FUNC( wrapStartThreads ), 3 );
+  rb_define_method( cRubyClass, "flush", RUBY_METHOD_FUNC( wrapFlush ), 0 );
+  rb_define_method( cRubyClass, "dropped_frames",
+                    RUBY_METHOD_FUNC( wrapDroppedFrames ), 0 );
+  rb_define_method( cRubyClass, "duplicated_frames",
+                    RUBY_METHOD_FUNC( wrapDuplicatedFrames ), 0 );
+  rb_define_method( cRubyClass, "max_latency",
+                    RUBY_METHOD_FUNC( wrapMaxLatency ), 0 );
+  rb_define_method( cRubyClass, "zero_copy=",
+                    RUBY_METHOD_FUNC( wrapSetZeroCopy ), 1 );
+  rb_define_method( cRubyClass, "data", RUBY_METHOD_FUNC( wrapData ), 0 );
+  rb_define_method( cRubyClass, "take_data", RUBY_METHOD_FUNC( wrapTakeData ), 1 );
+  rb_define_method( cRubyClass, "segments", RUBY_METHOD_FUNC( wrapSegments ), 0 );
+}
+
+void AVOutput::markRubyMembers(void)
+{
+  boost::mutex::scoped_lock lock( m_pinnedMutex );
+  for ( multimap< uint8_t *, VALUE >::iterator i = m_pinned.begin();
+        i != m_pinned.end(); i++ )
+    rb_gc_mark( i->second );
+}
+
+void AVOutput::markRubyObject( void *ptr )
+{
+  (*(AVOutputPtr *)ptr)->markRubyMembers();
 }
 
 void AVOutput::deleteRubyObject( void *ptr )
 {
+  (*(AVOutputPtr *)ptr)->close( true );
   delete (AVOutputPtr *)ptr;
 }
 
+size_t AVOutput::memorySizeRubyObject( const void *ptr )
+{
+  return (*(AVOutputPtr *)ptr)->memorySize();
+}
+
 VALUE AVOutput::wrapNew( VALUE rbClass, VALUE rbMRL, VALUE rbBitRate, VALUE rbWidth,
                          VALUE rbHeight, VALUE rbTimeBaseNum, VALUE rbTimeBaseDen,
                          VALUE rbAspectRatioNum, VALUE rbAspectRatioDen,
                          VALUE rbVideoCodec, VALUE rbAudioBitRate, VALUE rbSampleRate,
-                         VALUE rbChannels, VALUE rbAudioCodec )
+                         VALUE rbChannels, VALUE rbAudioCodec, VALUE rbOptions,
+                         VALUE rbSink )
 {
   VALUE retVal = Qnil;
   try {
     rb_check_type( rbMRL, T_STRING );
+    rb_check_type( rbOptions, T_ARRAY );
+    map< string, string > options;
+    for ( int i=0; i<RARRAY_LEN( rbOptions ); i++ ) {
+      VALUE rbPair = rb_ary_entry( rbOptions, i );
+      VALUE rbKey = rb_ary_entry( rbPair, 0 );
+      VALUE rbValue = rb_ary_entry( rbPair, 1 );
+      options[ StringValuePtr( rbKey ) ] = StringValuePtr( rbValue );
+    };
     AVOutputPtr ptr( new AVOutput( StringValuePtr( rbMRL ), NUM2INT( rbBitRate ),
                                    NUM2INT( rbWidth ), NUM2INT( rbHeight ),
                                    NUM2INT( rbTimeBaseNum ), NUM2INT( rbTimeBaseDen ),
@@ -819,9 +1853,36 @@ VALUE AVOutput::wrapNew( VALUE rbClass, VALUE rbMRL, VALUE rbBitRate, VALUE rbWi
                                    (enum AVCodecID)NUM2INT( rbVideoCodec ),
                                    NUM2INT( rbAudioBitRate ), NUM2INT( rbSampleRate ),
                                    NUM2INT( rbChannels ),
-                                   (enum AVCodecID)NUM2INT( rbAudioCodec ) ) );
-    retVal = Data_Wrap_Struct( rbClass, 0, deleteRubyObject,
-                               new AVOutputPtr( ptr ) );
+                                   (enum AVCodecID)NUM2INT( rbAudioCodec ),
+                                   options, NUM2INT( rbSink ) ) );
+    retVal = TypedData_Wrap_Struct( rbClass, &dataType, new AVOutputPtr( ptr ) );
+  } catch ( exception &e ) {
+    rb_raise( rb_eRuntimeError, "%s", e.what() );
+  };
+  return retVal;
+}
+
+VALUE AVOutput::wrapStreamCopy( VALUE rbClass, VALUE rbMRL, VALUE rbInput )
+{
+  VALUE retVal = Qnil;
+  try {
+    rb_check_type( rbMRL, T_STRING );
+    AVInputPtr *input;
+    TypedData_Get_Struct( rbInput, AVInputPtr, &AVInput::dataType, input );
+    AVOutputPtr ptr( new AVOutput( StringValuePtr( rbMRL ), *input ) );
+    retVal = TypedData_Wrap_Struct( rbClass, &dataType, new AVOutputPtr( ptr ) );
+  } catch ( exception &e ) {
+    rb_raise( rb_eRuntimeError, "%s", e.what() );
+  };
+  return retVal;
+}
+
+VALUE AVOutput::wrapDefaultVideoCodec( VALUE, VALUE rbMRL )
+{
+  VALUE retVal = Qnil;
+  try {
+    rb_check_type( rbMRL, T_STRING );
+    retVal = INT2NUM( guessFormat( StringValuePtr( rbMRL ) )->video_codec );
   } catch ( exception &e ) {
     rb_raise( rb_eRuntimeError, "%s", e.what() );
   };
@@ -830,8 +1891,13 @@ VALUE AVOutput::wrapNew( VALUE rbClass, VALUE rbMRL, VALUE rbBitRate, VALUE rbWi
 
 VALUE AVOutput::wrapClose( VALUE rbSelf )
 {
-  AVOutputPtr *self; Data_Get_Struct( rbSelf, AVOutputPtr, self );
-  (*self)->close();
+  AVOutputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
+  try {
+    (*self)->close();
+  } catch ( exception &e ) {
+    rb_raise( rb_eRuntimeError, "%s", e.what() );
+  };
   return rbSelf;
 }
 
@@ -839,7 +1905,8 @@ VALUE AVOutput::wrapVideoTimeBase( VALUE rbSelf )
 {
   VALUE retVal = Qnil;
   try {
-    AVOutputPtr *self; Data_Get_Struct( rbSelf, AVOutputPtr, self );
+    AVOutputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
     AVRational videoTimeBase = (*self)->videoTimeBase();
     retVal = rb_funcall( rb_cObject, rb_intern( "Rational" ), 2,
                          INT2NUM( videoTimeBase.num ), INT2NUM( videoTimeBase.den ) );
@@ -853,7 +1920,8 @@ VALUE AVOutput::wrapAudioTimeBase( VALUE rbSelf )
 {
   VALUE retVal = Qnil;
   try {
-    AVOutputPtr *self; Data_Get_Struct( rbSelf, AVOutputPtr, self );
+    AVOutputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
     AVRational audioTimeBase = (*self)->audioTimeBase();
     retVal = rb_funcall( rb_cObject, rb_intern( "Rational" ), 2,
                          INT2NUM( audioTimeBase.num ), INT2NUM( audioTimeBase.den ) );
@@ -867,7 +1935,8 @@ VALUE AVOutput::wrapFrameSize( VALUE rbSelf )
 {
   VALUE rbRetVal = Qnil;
   try {
-    AVOutputPtr *self; Data_Get_Struct( rbSelf, AVOutputPtr, self );
+    AVOutputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
     rbRetVal = INT2NUM( (*self)->frameSize() );
   } catch ( exception &e ) {
     rb_raise( rb_eRuntimeError, "%s", e.what() );
@@ -879,7 +1948,8 @@ VALUE AVOutput::wrapChannels( VALUE rbSelf )
 {
   VALUE rbRetVal = Qnil;
   try {
-    AVOutputPtr *self; Data_Get_Struct( rbSelf, AVOutputPtr, self );
+    AVOutputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
     rbRetVal = INT2NUM( (*self)->channels() );
   } catch ( exception &e ) {
     rb_raise( rb_eRuntimeError, "%s", e.what() );
@@ -887,27 +1957,141 @@ VALUE AVOutput::wrapChannels( VALUE rbSelf )
   return rbRetVal;
 }
 
-VALUE AVOutput::wrapWriteVideo( VALUE rbSelf, VALUE rbFrame )
+VALUE AVOutput::wrapWriteVideo( VALUE rbSelf, VALUE rbFrame, VALUE rbTime )
 {
   try {
-    AVOutputPtr *self; Data_Get_Struct( rbSelf, AVOutputPtr, self );
+    AVOutputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
     FramePtr frame( new Frame( rbFrame ) );
-    (*self)->writeVideo( frame );
+    (*self)->writeVideo( frame, NUM2LL( rbTime ) );
   } catch ( exception &e ) {
     rb_raise( rb_eRuntimeError, "%s", e.what() );
   };
   return rbFrame;
 }
 
-VALUE AVOutput::wrapWriteAudio( VALUE rbSelf, VALUE rbFrame )
+VALUE AVOutput::wrapWriteAudio( VALUE rbSelf, VALUE rbFrame, VALUE rbFormat,
+                                VALUE rbTime )
 {
   try {
-    AVOutputPtr *self; Data_Get_Struct( rbSelf, AVOutputPtr, self );
+    AVOutputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
     SequencePtr frame( new Sequence( rbFrame ) );
-    (*self)->writeAudio( frame );
+    (*self)->writeAudio( frame, (enum AVSampleFormat)NUM2INT( rbFormat ),
+                         NUM2LL( rbTime ) );
   } catch ( exception &e ) {
     rb_raise( rb_eRuntimeError, "%s", e.what() );
   };
   return rbFrame;
 }
 
+VALUE AVOutput::wrapCopyPacket( VALUE rbSelf, VALUE rbInput )
+{
+  VALUE rbRetVal = Qnil;
+  try {
+    AVOutputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
+    AVInputPtr *input;
+    TypedData_Get_Struct( rbInput, AVInputPtr, &AVInput::dataType, input );
+    rbRetVal = (*self)->copyPacket( *input ) ? Qtrue : Qfalse;
+  } catch ( exception &e ) {
+    rb_raise( rb_eRuntimeError, "%s", e.what() );
+  };
+  return rbRetVal;
+}
+
+VALUE AVOutput::wrapRemux( VALUE rbSelf, VALUE rbInput, VALUE rbStart, VALUE rbEnd )
+{
+  try {
+    AVOutputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
+    AVInputPtr *input;
+    TypedData_Get_Struct( rbInput, AVInputPtr, &AVInput::dataType, input );
+    (*self)->remux( *input, NUM2LL( rbStart ), NUM2LL( rbEnd ) );
+  } catch ( exception &e ) {
+    rb_raise( rb_eRuntimeError, "%s", e.what() );
+  };
+  return rbSelf;
+}
+
+VALUE AVOutput::wrapStartThreads( VALUE rbSelf, VALUE rbQueueSize, VALUE rbDrop,
+                                  VALUE rbLatency )
+{
+  try {
+    AVOutputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
+    (*self)->startThreads( NUM2INT( rbQueueSize ), rbDrop == Qtrue,
+                           NUM2LL( rbLatency ) );
+  } catch ( exception &e ) {
+    rb_raise( rb_eRuntimeError, "%s", e.what() );
+  };
+  return rbSelf;
+}
+
+VALUE AVOutput::wrapFlush( VALUE rbSelf )
+{
+  try {
+    AVOutputPtr *self;
+    TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
+    (*self)->flush();
+  } catch ( exception &e ) {
+    rb_raise( rb_eRuntimeError, "%s", e.what() );
+  };
+  return rbSelf;
+}
+
+VALUE AVOutput::wrapDroppedFrames( VALUE rbSelf )
+{
+  AVOutputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
+  return LL2NUM( (*self)->droppedFrames() );
+}
+
+VALUE AVOutput::wrapDuplicatedFrames( VALUE rbSelf )
+{
+  AVOutputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
+  return LL2NUM( (*self)->duplicatedFrames() );
+}
+
+VALUE AVOutput::wrapMaxLatency( VALUE rbSelf )
+{
+  AVOutputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
+  return LL2NUM( (*self)->maxLatency() );
+}
+
+VALUE AVOutput::wrapSetZeroCopy( VALUE rbSelf, VALUE rbZeroCopy )
+{
+  AVOutputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
+  (*self)->setZeroCopy( RTEST( rbZeroCopy ) );
+  return rbZeroCopy;
+}
+
+VALUE AVOutput::wrapData( VALUE rbSelf )
+{
+  AVOutputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
+  string data = (*self)->data();
+  return rb_str_new( data.data(), data.size() );
+}
+
+VALUE AVOutput::wrapTakeData( VALUE rbSelf, VALUE rbMinSize )
+{
+  AVOutputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
+  string data = (*self)->takeData( NUM2INT( rbMinSize ) );
+  return rb_str_new( data.data(), data.size() );
+}
+
+VALUE AVOutput::wrapSegments( VALUE rbSelf )
+{
+  AVOutputPtr *self;
+  TypedData_Get_Struct( rbSelf, AVOutputPtr, &AVOutput::dataType, self );
+  vector< string > segments = (*self)->segments();
+  VALUE rbRetVal = rb_ary_new();
+  for ( unsigned int i=0; i<segments.size(); i++ )
+    rb_ary_push( rbRetVal, rb_str_new2( segments[i].c_str() ) );
+  return rbRetVal;
+}
@@ -20,7 +20,11 @@
 #include "config.h"
 #endif
 
+#include <map>
+#include <vector>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 extern "C" {
 #ifndef HAVE_LIBSWSCALE_INCDIR
   #include <ffmpeg/swscale.h>
@@ -32,56 +36,197 @@ extern "C" {
 #else
   #include <ffmpeg/avformat.h>
 #endif
+  #include <libavutil/audio_fifo.h>
+  #include <libswresample/swresample.h>
 }
 #include "rubyinc.hh"
 #include "error.hh"
 #include "frame.hh"
 #include "sequence.hh"
+#include "avinput.hh"
+#include "boundedqueue.hh"
 
 class AVOutput
 {
 public:
+  enum { FILE_SINK, MEMORY_SINK, STREAM_SINK };
   AVOutput( const std::string &mrl, int videoBitRate, int width, int height,
             int timeBaseNum, int timeBaseDen, int aspectRatioNum,
             int aspectRatioDen, enum AVCodecID videoCodec,
             int audioBitRate, int sampleRate, int channels,
-            enum AVCodecID audioCodec ) throw (Error);
+            enum AVCodecID audioCodec,
+            const std::map< std::string, std::string > &options =
+              std::map< std::string, std::string >(),
+            int sink = FILE_SINK ) throw (Error);
+  AVOutput( const std::string &mrl, AVInputPtr input ) throw (Error);
   virtual ~AVOutput(void);
-  void close(void);
+  void close( bool collected = false ) throw (Error);
   AVRational videoTimeBase(void) throw (Error);
   AVRational audioTimeBase(void) throw (Error);
+  int width(void) throw (Error);
+  int height(void) throw (Error);
   int frameSize(void) throw (Error);
   int channels(void) throw (Error);
-  void writeVideo( FramePtr frame ) throw (Error);
-  void writeAudio( SequencePtr frame ) throw (Error);
+  void writeVideo( FramePtr frame, long long time = AV_NOPTS_VALUE ) throw (Error);
+  void writeVideo( AVFrame *picture, long long time = AV_NOPTS_VALUE ) throw (Error);
+  void writeScaledVideo( AVFrame *frame, long long time = AV_NOPTS_VALUE )
+    throw (Error);
+  AVFrame *allocVideoFrame(void) throw (Error);
+  static void frameLayout( FramePtr frame, AVFrame *picture ) throw (Error);
+  void writeAudio( SequencePtr frame,
+                   enum AVSampleFormat format = AV_SAMPLE_FMT_S16,
+                   long long time = AV_NOPTS_VALUE ) throw (Error);
+  void writeAudio( AVFrame *frame, long long time = AV_NOPTS_VALUE ) throw (Error);
+  void flushAudio(void) throw (Error);
+  bool copyPacket( AVInputPtr input, long long end = AV_NOPTS_VALUE ) throw (Error);
+  void remux( AVInputPtr input, long long start, long long end ) throw (Error);
+  void startThreads( int queueSize, bool drop, long long latency = 0 )
+    throw (Error);
+  bool async(void) const { return m_async; }
+  bool hasAudio(void) const { return m_audioEnc != NULL; }
+  void flush(void) throw (Error);
+  long long droppedFrames(void) const { return m_droppedFrames; }
+  long long duplicatedFrames(void) const { return m_duplicatedFrames; }
+  long long latency(void);
+  long long maxLatency(void);
+  void setZeroCopy( bool zeroCopy ) { m_zeroCopy = zeroCopy; }
+  std::string data(void);
+  std::string takeData( int minSize );
+  std::vector< std::string > segments(void);
+  void markRubyMembers(void);
   static VALUE cRubyClass;
   static VALUE registerRubyClass( VALUE rbModule );
+  static void markRubyObject( void *ptr );
   static void deleteRubyObject( void *ptr );
+  static size_t memorySizeRubyObject( const void *ptr );
+  static const rb_data_type_t dataType;
+  size_t memorySize(void);
   static VALUE wrapNew( VALUE rbClass, VALUE rbMRL, VALUE rbBitRate, VALUE rbWidth,
                         VALUE rbHeight, VALUE rbTimeBaseNum, VALUE rbTimeBaseDen,
                         VALUE rbAspectRatioNum, VALUE rbAspectRatioDen,
                         VALUE rbVideoCodec, VALUE rbAudioBitRate, VALUE rbSampleRate,
-                        VALUE rbChannels, VALUE rbAudioCodec );
+                        VALUE rbChannels, VALUE rbAudioCodec, VALUE rbOptions,
+                        VALUE rbSink );
+  static VALUE wrapStreamCopy( VALUE rbClass, VALUE rbMRL, VALUE rbInput );
+  static VALUE wrapDefaultVideoCodec( VALUE rbClass, VALUE rbMRL );
   static VALUE wrapClose( VALUE rbSelf );
   static VALUE wrapVideoTimeBase( VALUE rbSelf );
   static VALUE wrapAudioTimeBase( VALUE rbSelf );
   static VALUE wrapFrameSize( VALUE rbSelf );
   static VALUE wrapChannels( VALUE rbSelf );
-  static VALUE wrapWriteVideo( VALUE rbSelf, VALUE rbFrame );
-  static VALUE wrapWriteAudio( VALUE rbSelf, VALUE rbFrame );
+  static VALUE wrapWriteVideo( VALUE rbSelf, VALUE rbFrame, VALUE rbTime );
+  static VALUE wrapWriteAudio( VALUE rbSelf, VALUE rbFrame, VALUE rbFormat,
+                               VALUE rbTime );
+  static VALUE wrapCopyPacket( VALUE rbSelf, VALUE rbInput );
+  static VALUE wrapRemux( VALUE rbSelf, VALUE rbInput, VALUE rbStart, VALUE rbEnd );
+  static VALUE wrapStartThreads( VALUE rbSelf, VALUE rbQueueSize, VALUE rbDrop,
+                                 VALUE rbLatency );
+  static VALUE wrapFlush( VALUE rbSelf );
+  static VALUE wrapDroppedFrames( VALUE rbSelf );
+  static VALUE wrapDuplicatedFrames( VALUE rbSelf );
+  static VALUE wrapMaxLatency( VALUE rbSelf );
+  static VALUE wrapSetZeroCopy( VALUE rbSelf, VALUE rbZeroCopy );
+  static VALUE wrapData( VALUE rbSelf );
+  static VALUE wrapTakeData( VALUE rbSelf, VALUE rbMinSize );
+  static VALUE wrapSegments( VALUE rbSelf );
 protected:
+  struct EncodeItem {
+    AVFrame *frame;
+    bool video;
+    long long queued;
+  };
+  static AVOutputFormat *guessFormat( const std::string &mrl ) throw (Error);
+  AVFormatContext *allocContext( const std::string &mrl ) throw (Error);
+  AVStream *copyStream( AVStream *source ) throw (Error);
+  void openFile( AVDictionary **options = NULL ) throw (Error);
+  static int writeData( void *opaque, uint8_t *buf, int size );
+  static int64_t seekData( void *opaque, int64_t offset, int whence );
+  void encode( AVCodecContext *c, AVFrame *frame ) throw (Error);
+  bool zeroCopyPossible( AVFrame *picture );
+  AVFrame *wrapFrame( FramePtr frame, AVFrame *picture ) throw (Error);
+  static void releaseFrame( void *opaque, uint8_t *data );
+  long long nextVideoPts( long long time ) throw (Error);
+  void audioGap( long long time ) throw (Error);
+  void submit( AVFrame *frame, bool video ) throw (Error);
+  void writePacket( AVPacket *packet ) throw (Error);
+  void muxPacket( AVPacket *packet ) throw (Error);
+  std::string segmentName( int index ) throw (Error);
+  AVStream *addStream( AVFormatContext *oc, AVCodecContext *c ) throw (Error);
+  void nextSegment(void) throw (Error);
+  AVPacket *allocPacket(void) throw (Error);
+  void recyclePacket( AVPacket *packet );
+  AVFrame *allocAudioFrame(void) throw (Error);
+  void bufferAudio( const uint8_t **data, int samples, enum AVSampleFormat format,
+                    int sampleRate, int channels ) throw (Error);
+  void convertAudio( const uint8_t **data, int samples ) throw (Error);
+  void encodeAudio( int samples ) throw (Error);
+  void stopThreads(void);
+  void checkThreadError(void) throw (Error);
+  void encodeLoop(void);
+  void muxLoop(void);
+  std::string m_name;
+  bool m_open;
   std::string m_mrl;
   AVFormatContext *m_oc;
+  boost::mutex m_containerMutex;
   AVStream *m_videoStream;
   AVStream *m_audioStream;
-  bool m_videoCodecOpen;
-  bool m_audioCodecOpen;
-  char *m_videoBuf;
-  char *m_audioBuf;
+  int m_videoIndex;
+  int m_audioIndex;
+  AVCodecContext *m_videoEnc;
+  AVCodecContext *m_audioEnc;
+  int m_sink;
   bool m_fileOpen;
   bool m_headerWritten;
   struct SwsContext *m_swsContext;
   AVFrame *m_frame;
+  AVFrame *m_audioFrame;
+  AVPacket *m_packet;
+  AVAudioFifo *m_audioFifo;
+  int m_audioFrameSize;
+  int m_inputSampleRate;
+  struct SwrContext *m_swrContext;
+  enum AVSampleFormat m_swrFormat;
+  int m_swrSampleRate;
+  int m_swrChannels;
+  uint8_t **m_convertData;
+  int m_convertSize;
+  long long m_videoPts;
+  long long m_audioPts;
+  long long m_copyOffset;
+  bool m_async;
+  bool m_dropFrames;
+  long long m_droppedFrames;
+  long long m_latencyBudget;
+  long long m_startTime;
+  long long m_duplicatedFrames;
+  AVFrame *m_lastFrame;
+  long long m_encoding;
+  long long m_maxLatency;
+  boost::mutex m_latencyMutex;
+  AVBufferPool *m_videoPool;
+  boost::shared_ptr< BoundedQueue< EncodeItem > > m_encodeQueue;
+  boost::shared_ptr< BoundedQueue< AVPacket * > > m_packetQueue;
+  boost::shared_ptr< boost::thread > m_encodeThread;
+  boost::shared_ptr< boost::thread > m_muxThread;
+  std::string m_threadError;
+  boost::mutex m_errorMutex;
+  std::vector< AVPacket * > m_packetPool;
+  boost::mutex m_packetPoolMutex;
+  bool m_zeroCopy;
+  std::multimap< uint8_t *, VALUE > m_pinned;
+  boost::mutex m_pinnedMutex;
+  std::string m_data;
+  size_t m_dataPos;
+  boost::mutex m_dataMutex;
+  std::string m_segmentPattern;
+  long long m_segmentTime;
+  long long m_segmentSize;
+  long long m_segmentStart;
+  int m_segmentIndex;
+  AVDictionary *m_formatOptions;
+  std::vector< std::string > m_segments;
+  boost::mutex m_segmentMutex;
 };
 
 typedef boost::shared_ptr< AVOutput > AVOutputPtr;
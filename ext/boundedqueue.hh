@@ -0,0 +1,49 @@
+/* HornetsEye - Computer Vision with Ruby
+   Copyright (C) 2006, 2007, 2008, 2009, 2010   Jan Wedekind
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef BOUNDEDQUEUE_HH
+#define BOUNDEDQUEUE_HH
+
+#include <deque>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+// Thread-safe FIFO with limited capacity. The consumer calls done after
+// processing an element so that waitIdle can wait for all pending work.
+template< typename T >
+class BoundedQueue
+{
+public:
+  BoundedQueue( int capacity );
+  virtual ~BoundedQueue(void) {}
+  void push( const T &t );
+  bool tryPush( const T &t );
+  T pop(void);
+  void done(void);
+  void waitIdle(void);
+  int size(void);
+protected:
+  std::deque< T > m_queue;
+  int m_capacity;
+  int m_pending;
+  boost::mutex m_mutex;
+  boost::condition_variable m_notFull;
+  boost::condition_variable m_notEmpty;
+  boost::condition_variable m_idle;
+};
+
+#include "boundedqueue.tcc"
+
+#endif
@@ -0,0 +1,77 @@
+/* HornetsEye - Computer Vision with Ruby
+   Copyright (C) 2006, 2007, 2008, 2009, 2010   Jan Wedekind
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+template< typename T >
+BoundedQueue< T >::BoundedQueue( int capacity ):
+  m_capacity( capacity > 0 ? capacity : 1 ), m_pending( 0 )
+{
+}
+
+template< typename T >
+void BoundedQueue< T >::push( const T &t )
+{
+  boost::mutex::scoped_lock lock( m_mutex );
+  while ( (int)m_queue.size() >= m_capacity )
+    m_notFull.wait( lock );
+  m_queue.push_back( t );
+  m_pending++;
+  m_notEmpty.notify_one();
+}
+
+template< typename T >
+bool BoundedQueue< T >::tryPush( const T &t )
+{
+  boost::mutex::scoped_lock lock( m_mutex );
+  if ( (int)m_queue.size() >= m_capacity ) return false;
+  m_queue.push_back( t );
+  m_pending++;
+  m_notEmpty.notify_one();
+  return true;
+}
+
+template< typename T >
+T BoundedQueue< T >::pop(void)
+{
+  boost::mutex::scoped_lock lock( m_mutex );
+  while ( m_queue.empty() )
+    m_notEmpty.wait( lock );
+  T retVal = m_queue.front();
+  m_queue.pop_front();
+  m_notFull.notify_one();
+  return retVal;
+}
+
+template< typename T >
+void BoundedQueue< T >::done(void)
+{
+  boost::mutex::scoped_lock lock( m_mutex );
+  m_pending--;
+  if ( m_pending == 0 ) m_idle.notify_all();
+}
+
+template< typename T >
+void BoundedQueue< T >::waitIdle(void)
+{
+  boost::mutex::scoped_lock lock( m_mutex );
+  while ( m_pending > 0 )
+    m_idle.wait( lock );
+}
+
+template< typename T >
+int BoundedQueue< T >::size(void)
+{
+  boost::mutex::scoped_lock lock( m_mutex );
+  return m_queue.size();
+}
@@ -13,56 +13,97 @@
 
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <cstdlib>
+#include <cstring>
 #include "frame.hh"
 
 using namespace std;
 
+VALUE Frame::mModule = Qnil;
+VALUE Frame::cMalloc = Qnil;
+VALUE Frame::cFrame = Qnil;
+VALUE Frame::cMultiArray = Qnil;
+ID Frame::idImport = 0;
+ID Frame::idTypecode = 0;
+ID Frame::idToS = 0;
+ID Frame::idWidth = 0;
+ID Frame::idHeight = 0;
+ID Frame::idMemory = 0;
+ID Frame::idSize = 0;
+ID Frame::idStorageSize = 0;
+ID Frame::idRGB = 0;
+ID Frame::idAtSize = 0;
+
+map< string, VALUE > Frame::typecodes;
+
 Frame::Frame( const string &typecode, int width, int height, char *data ):
-  m_frame( Qnil )
+  m_frame( Qnil ), m_typecode( typecode ), m_width( width ), m_height( height ),
+  m_data( data ), m_storageSize( storageSize( typecode, width, height ) )
 {
-  VALUE mModule = rb_define_module( "Hornetseye" );
-  VALUE cMalloc = rb_define_class_under( mModule, "Malloc", rb_cObject );
-  VALUE cFrame = rb_define_class_under( mModule, "Frame", rb_cObject );
-  VALUE rbSize = INT2NUM( storageSize( typecode, width, height ) );
+  VALUE rbSize = INT2NUM( m_storageSize );
   VALUE rbMemory;
   if ( data != NULL ) {
     rbMemory = Data_Wrap_Struct( cMalloc, 0, 0, (void *)data );
-    rb_ivar_set( rbMemory, rb_intern( "@size" ), rbSize );
+    rb_ivar_set( rbMemory, idAtSize, rbSize );
   } else
-    rbMemory = rb_funcall( cMalloc, rb_intern( "new" ), 1, rbSize );
-  m_frame = rb_funcall( cFrame, rb_intern( "import" ), 4,
-                        rb_const_get( mModule, rb_intern( typecode.c_str() ) ),
-                        INT2NUM( width ), INT2NUM( height ), rbMemory );
+    rbMemory = allocMemory( m_storageSize, &m_data );
+  if ( typecode == "UBYTE" )
+    // Grayscale images are plain two-dimensional arrays.
+    m_frame = rb_funcall( cMultiArray, idImport, 4, typecodeObject( typecode ),
+                          rbMemory, INT2NUM( width ), INT2NUM( height ) );
+  else
+    m_frame = rb_funcall( cFrame, idImport, 4, typecodeObject( typecode ),
+                          INT2NUM( width ), INT2NUM( height ), rbMemory );
 }
 
-string Frame::typecode(void)
+Frame::Frame( VALUE rbFrame ):
+  m_frame( rbFrame ), m_storageSize( -1 )
 {
-  VALUE rbString = rb_funcall( rb_funcall( m_frame, rb_intern( "typecode" ), 0 ),
-                               rb_intern( "to_s" ), 0 );
-  return StringValuePtr( rbString );
+  // The properties are looked up once instead of on every access.
+  VALUE rbString = rb_funcall( rb_funcall( m_frame, idTypecode, 0 ), idToS, 0 );
+  m_typecode = StringValuePtr( rbString );
+  m_width = NUM2INT( rb_funcall( m_frame, idWidth, 0 ) );
+  m_height = NUM2INT( rb_funcall( m_frame, idHeight, 0 ) );
+  m_data = memoryData( rb_funcall( m_frame, idMemory, 0 ) );
 }
 
-int Frame::width(void)
+int Frame::storageSize(void)
 {
-  return NUM2INT( rb_funcall( m_frame, rb_intern( "width" ), 0 ) );
+  if ( m_storageSize < 0 )
+    m_storageSize = storageSize( m_typecode, m_width, m_height );
+  return m_storageSize;
 }
 
-int Frame::height(void)
+int Frame::lineSize( int plane )
 {
-  return NUM2INT( rb_funcall( m_frame, rb_intern( "height" ), 0 ) );
+  if ( m_typecode == "YV12" || m_typecode == "I420" ) {
+    // Lines of all planes are padded to a multiple of 8 bytes.
+    int width = plane == 0 ? m_width : ( m_width + 1 ) / 2;
+    return ( width + 7 ) & ~0x7;
+  } else if ( plane > 0 )
+    return 0;
+  else if ( m_typecode == "UBYTERGB" )
+    return 3 * m_width;
+  else
+    return storageSize() / m_height;
 }
 
-char *Frame::data(void)
+char *Frame::plane( int plane )
 {
-  VALUE rbMemory = rb_funcall( m_frame, rb_intern( "memory" ), 0 );
-  char *ptr;
-  Data_Get_Struct( rbMemory, char, ptr );
-  return ptr;
+  if ( m_typecode == "YV12" || m_typecode == "I420" ) {
+    // Planes are in the order Y, U, V. YV12 stores V before U.
+    if ( plane == 0 ) return m_data;
+    bool first = ( plane == 1 ) == ( m_typecode == "I420" );
+    char *retVal = m_data + lineSize( 0 ) * m_height;
+    if ( !first ) retVal += lineSize( 1 ) * ( ( m_height + 1 ) / 2 );
+    return retVal;
+  } else
+    return plane == 0 ? m_data : NULL;
 }
 
 bool Frame::rgb(void)
 {
-  return rb_funcall( m_frame, rb_intern( "rgb?" ), 0 ) != Qfalse;
+  return rb_funcall( m_frame, idRGB, 0 ) != Qfalse;
 }
 
 void Frame::markRubyMember(void)
@@ -72,10 +113,85 @@ void Frame::markRubyMember(void)
 
 int Frame::storageSize( const std::string &typecode, int width, int height )
 {
-  VALUE mModule = rb_define_module( "Hornetseye" );
-  VALUE cFrame = rb_define_class_under( mModule, "Frame", rb_cObject );
-  return NUM2INT( rb_funcall( cFrame, rb_intern( "storage_size" ), 3,
-                              rb_const_get( mModule, rb_intern( typecode.c_str() ) ),
+  if ( typecode == "UBYTE" ) return width * height;
+  return NUM2INT( rb_funcall( cFrame, idStorageSize, 3, typecodeObject( typecode ),
                               INT2NUM( width ), INT2NUM( height ) ) );
 }
- 
+
+VALUE Frame::registerRubyClass( VALUE rbModule )
+{
+  mModule = rbModule;
+  cMalloc = rb_define_class_under( rbModule, "Malloc", rb_cObject );
+  cFrame = rb_define_class_under( rbModule, "Frame", rb_cObject );
+  cMultiArray = rb_define_class_under( rbModule, "MultiArray", rb_cObject );
+  idImport = rb_intern( "import" );
+  idTypecode = rb_intern( "typecode" );
+  idToS = rb_intern( "to_s" );
+  idWidth = rb_intern( "width" );
+  idHeight = rb_intern( "height" );
+  idMemory = rb_intern( "memory" );
+  idSize = rb_intern( "size" );
+  idStorageSize = rb_intern( "storage_size" );
+  idRGB = rb_intern( "rgb?" );
+  idAtSize = rb_intern( "@size" );
+  return cFrame;
+}
+
+VALUE Frame::typecodeObject( const string &typecode )
+{
+  // Typecodes are constants and therefore never garbage collected.
+  map< string, VALUE >::iterator i = typecodes.find( typecode );
+  if ( i != typecodes.end() ) return i->second;
+  VALUE retVal = rb_const_get( mModule, rb_intern( typecode.c_str() ) );
+  typecodes[ typecode ] = retVal;
+  return retVal;
+}
+
+VALUE Frame::allocMemory( int size, char **data )
+{
+  size_t total = ALIGNMENT + size + PADDING;
+  void *ptr;
+#ifdef WIN32
+  ptr = _aligned_malloc( total, ALIGNMENT );
+#else
+  if ( posix_memalign( &ptr, ALIGNMENT, total ) != 0 ) ptr = NULL;
+#endif
+  if ( ptr == NULL ) rb_memerror();
+  *(size_t *)ptr = total;
+  char *retPtr = (char *)ptr + ALIGNMENT;
+  // Reading the padding gives deterministic results.
+  memset( retPtr + size, 0, PADDING );
+  // Let the garbage collector see the native memory held by the frame.
+  adjustMemoryUsage( total );
+  VALUE retVal = Data_Wrap_Struct( cMalloc, 0, freeMemory, retPtr );
+  rb_ivar_set( retVal, idAtSize, INT2NUM( size ) );
+  *data = retPtr;
+  return retVal;
+}
+
+void Frame::freeMemory( void *ptr )
+{
+  char *base = (char *)ptr - ALIGNMENT;
+  adjustMemoryUsage( -(long)*(size_t *)base );
+#ifdef WIN32
+  _aligned_free( base );
+#else
+  free( base );
+#endif
+}
+
+void Frame::adjustMemoryUsage( long diff )
+{
+#if defined(RUBY_API_VERSION_CODE) && RUBY_API_VERSION_CODE >= 20400
+  rb_gc_adjust_memory_usage( diff );
+#else
+  (void)diff;
+#endif
+}
+
+char *Frame::memoryData( VALUE rbMemory )
+{
+  char *ptr;
+  Data_Get_Struct( rbMemory, char, ptr );
+  return ptr;
+}
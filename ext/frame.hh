@@ -18,24 +18,58 @@
 
 #include <boost/smart_ptr.hpp>
 #include "rubyinc.hh"
+#include <map>
 #include <string>
 
 class Frame
 {
 public:
+  // Frame memory starts on a 64-byte boundary and is followed by padding so that
+  // SIMD loops can read beyond the last line. The allocation size is kept in a
+  // header of ALIGNMENT bytes in front of the memory.
+  enum { ALIGNMENT = 64, PADDING = 64 };
   Frame( const std::string &typecode, int width, int height, char *data = NULL );
-  Frame( VALUE rbFrame ): m_frame( rbFrame ) {}
+  Frame( VALUE rbFrame );
   virtual ~Frame(void) {}
-  std::string typecode(void);
-  int width(void);
-  int height(void);
-  char *data(void);
+  std::string typecode(void) { return m_typecode; }
+  int width(void) { return m_width; }
+  int height(void) { return m_height; }
+  char *data(void) { return m_data; }
+  int storageSize(void);
+  int lineSize( int plane );
+  char *plane( int plane );
   bool rgb(void);
   VALUE rubyObject(void) { return m_frame; }
   void markRubyMember(void);
   static int storageSize( const std::string &typecode, int width, int height );
+  static VALUE registerRubyClass( VALUE rbModule );
+  static VALUE typecodeObject( const std::string &typecode );
+  static char *memoryData( VALUE rbMemory );
+  static VALUE allocMemory( int size, char **data );
+  static void freeMemory( void *ptr );
+  static void adjustMemoryUsage( long diff );
+  static VALUE mModule;
+  static VALUE cMalloc;
+  static VALUE cFrame;
+  static VALUE cMultiArray;
+  static ID idImport;
+  static ID idTypecode;
+  static ID idToS;
+  static ID idWidth;
+  static ID idHeight;
+  static ID idMemory;
+  static ID idSize;
+  static ID idStorageSize;
+  static ID idRGB;
+  static ID idAtSize;
 protected:
   VALUE m_frame;
+  std::string m_typecode;
+  int m_width;
+  int m_height;
+  char *m_data;
+  int m_storageSize;
+  static std::map< std::string, VALUE > typecodes;
 };
 
 typedef boost::shared_ptr< Frame > FramePtr;
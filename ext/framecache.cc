@@ -0,0 +1,334 @@
+/* HornetsEye - Computer Vision with Ruby
+   Copyright (C) 2006, 2007, 2008, 2009, 2010   Jan Wedekind
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "framecache.hh"
+
+// Frames start after a page reserved for the header.
+#define FRAMECACHE_VERSION 2
+#define FRAMECACHE_DATA_OFFSET 4096
+
+using namespace std;
+
+VALUE FrameCache::cRubyClass = Qnil;
+
+const rb_data_type_t FrameCache::dataType = {
+  "Hornetseye::FrameCache",
+  { 0, deleteRubyObject, 0, 0, { 0 } },
+  0, 0, 0
+};
+
+FrameCache::FrameCache( const string &path ) throw (Error):
+  m_path( path ), m_map( NULL ), m_mapSize( 0 ), m_header( NULL ), m_pts( NULL )
+{
+  int fd = open( path.c_str(), O_RDONLY );
+  ERRORMACRO( fd >= 0, Error, , "Error opening frame cache \"" << path << "\": "
+              << strerror( errno ) );
+  struct stat st;
+  void *map = MAP_FAILED;
+  if ( fstat( fd, &st ) == 0 && st.st_size >= (off_t)sizeof( Header ) ) {
+    m_mapSize = st.st_size;
+    // A private mapping lets Ruby code modify frames without touching the file.
+    map = mmap( NULL, m_mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+  };
+  ::close( fd );
+  ERRORMACRO( map != MAP_FAILED, Error, , "Error mapping frame cache \"" << path
+              << "\"" );
+  m_map = (char *)map;
+  m_header = (const Header *)m_map;
+  // Every frame and timestamp has to lie within the mapping. The sizes are
+  // compared by division so that a damaged header cannot overflow.
+  long long mapSize = m_mapSize;
+  string typecode = this->typecode();
+  bool ok = memcmp( m_header->magic, "HFFCACHE", 8 ) == 0 &&
+    m_header->version == FRAMECACHE_VERSION && m_header->complete &&
+    ( typecode == "UBYTE" || typecode == "YV12" ) &&
+    m_header->width > 0 && m_header->height > 0 &&
+    m_header->count > 0 && m_header->slotSize > 0 &&
+    m_header->dataOffset >= (long long)sizeof( Header ) &&
+    m_header->dataOffset <= mapSize &&
+    m_header->count <= ( mapSize - m_header->dataOffset ) / m_header->slotSize &&
+    m_header->dataOffset + m_header->count * m_header->slotSize <=
+      m_header->ptsOffset &&
+    m_header->ptsOffset <= mapSize &&
+    m_header->count <= ( mapSize - m_header->ptsOffset ) /
+      (long long)sizeof( long long ) &&
+    m_header->width <= m_header->slotSize / m_header->height &&
+    m_header->slotSize >= Frame::storageSize( typecode, m_header->width,
+                                              m_header->height );
+  if ( !ok ) {
+    munmap( m_map, m_mapSize );
+    m_map = NULL;
+    ERRORMACRO( false, Error, , "Frame cache \"" << path << "\" is incomplete or "
+                "corrupt" );
+  };
+  m_pts = (const long long *)( m_map + m_header->ptsOffset );
+}
+
+FrameCache::~FrameCache(void)
+{
+  if ( m_map != NULL ) munmap( m_map, m_mapSize );
+}
+
+void FrameCache::build( const string &path, const string &source, AVInputPtr input,
+                        int step, int cropX, int cropY, int cropWidth,
+                        int cropHeight ) throw (Error)
+{
+  ERRORMACRO( step > 0, Error, , "Frame step must be positive (but was " << step
+              << ")" );
+  Header header;
+  memset( &header, 0, sizeof( header ) );
+  memcpy( header.magic, "HFFCACHE", 8 );
+  header.version = FRAMECACHE_VERSION;
+  ERRORMACRO( sourceStat( source, &header.sourceSize, &header.sourceTime ), Error, ,
+              "Frame cache requires a local file (but source was \"" << source
+              << "\")" );
+  AVRational timeBase = input->videoTimeBase();
+  header.timeBaseNum = timeBase.num;
+  header.timeBaseDen = timeBase.den;
+  header.step = step;
+  header.cropX = cropX;
+  header.cropY = cropY;
+  header.cropWidth = cropWidth;
+  header.cropHeight = cropHeight;
+  header.dataOffset = FRAMECACHE_DATA_OFFSET;
+  // The cache is written to a temporary file and renamed when it is complete.
+  // Every process building the same cache gets a file of its own.
+  vector< char > name( path.begin(), path.end() );
+  const char *suffix = ".XXXXXX";
+  name.insert( name.end(), suffix, suffix + strlen( suffix ) + 1 );
+  int fd = mkstemp( &name[0] );
+  ERRORMACRO( fd >= 0, Error, , "Error creating frame cache \"" << path << "\": "
+              << strerror( errno ) );
+  string temp( &name[0] );
+  FILE *f = NULL;
+  if ( fchmod( fd, 0644 ) == 0 ) f = fdopen( fd, "wb" );
+  if ( f == NULL ) {
+    int err = errno;
+    ::close( fd );
+    remove( temp.c_str() );
+    ERRORMACRO( false, Error, , "Error creating frame cache \"" << temp << "\": "
+                << strerror( err ) );
+  };
+  try {
+    vector< char > zero( FRAMECACHE_DATA_OFFSET, 0 );
+    ERRORMACRO( fwrite( &zero[0], 1, zero.size(), f ) == zero.size(), Error, ,
+                "Error writing frame cache \"" << temp << "\"" );
+    vector< long long > pts;
+    FramePtr cropped;
+    int index = 0;
+    while ( true ) {
+      try {
+        input->readAV();
+      } catch ( Error &e ) {
+        // A truncated cache would be accepted until the source changes.
+        if ( input->eof() ) break;
+        throw e;
+      };
+      FramePtr frame = input->videoFrame();
+      if ( frame.get() == NULL || index++ % step != 0 ) continue;
+      if ( pts.empty() ) {
+        // The layout of the cache follows from the first frame.
+        string typecode = frame->typecode();
+        ERRORMACRO( typecode.size() < sizeof( header.typecode ), Error, ,
+                    "Typecode " << typecode << " is not supported" );
+        strcpy( header.typecode, typecode.c_str() );
+        header.width = frame->width();
+        header.height = frame->height();
+        if ( cropWidth > 0 && cropHeight > 0 ) {
+          ERRORMACRO( cropX >= 0 && cropY >= 0 &&
+                      cropX + cropWidth <= frame->width() &&
+                      cropY + cropHeight <= frame->height(), Error, ,
+                      "Crop area " << cropWidth << 'x' << cropHeight << '+'
+                      << cropX << '+' << cropY << " exceeds frame size "
+                      << frame->width() << 'x' << frame->height() );
+          ERRORMACRO( typecode == "UBYTE" || ( cropX % 2 == 0 && cropY % 2 == 0 ),
+                      Error, , "Crop offset of " << typecode << " frames must be "
+                      "even" );
+          cropped = FramePtr( new Frame( typecode, cropWidth, cropHeight ) );
+          header.width = cropWidth;
+          header.height = cropHeight;
+        };
+        header.slotSize = ( Frame::storageSize( typecode, header.width,
+                                                header.height ) +
+                            Frame::PADDING + Frame::ALIGNMENT - 1 ) &
+                          ~( Frame::ALIGNMENT - 1 );
+      };
+      if ( cropped.get() ) {
+        int planes = cropped->typecode() == "UBYTE" ? 1 : 3;
+        for ( int p=0; p<planes; p++ ) {
+          int scale = p == 0 ? 1 : 2;
+          int rows = ( cropHeight + scale - 1 ) / scale;
+          int bytes = ( cropWidth + scale - 1 ) / scale;
+          for ( int y=0; y<rows; y++ )
+            memcpy( cropped->plane( p ) + y * cropped->lineSize( p ),
+                    frame->plane( p ) + ( cropY / scale + y ) * frame->lineSize( p ) +
+                    cropX / scale, bytes );
+        };
+        frame = cropped;
+      };
+      size_t size = frame->storageSize();
+      ERRORMACRO( fwrite( frame->data(), 1, size, f ) == size &&
+                  fwrite( &zero[0], 1, header.slotSize - size, f ) ==
+                    (size_t)( header.slotSize - size ), Error, ,
+                  "Error writing frame cache \"" << temp << "\"" );
+      pts.push_back( input->videoPts() );
+    };
+    ERRORMACRO( !pts.empty(), Error, , "Video \"" << source << "\" does not have "
+                "any frames to cache" );
+    header.count = pts.size();
+    header.ptsOffset = header.dataOffset + header.count * header.slotSize;
+    header.complete = 1;
+    ERRORMACRO( fwrite( &pts[0], sizeof( long long ), pts.size(), f ) ==
+                  pts.size() && fseek( f, 0, SEEK_SET ) == 0 &&
+                fwrite( &header, sizeof( header ), 1, f ) == 1, Error, ,
+                "Error writing frame cache \"" << temp << "\"" );
+  } catch ( Error &e ) {
+    fclose( f );
+    remove( temp.c_str() );
+    throw e;
+  };
+  bool ok = fclose( f ) == 0 && rename( temp.c_str(), path.c_str() ) == 0;
+  if ( !ok ) remove( temp.c_str() );
+  ERRORMACRO( ok, Error, , "Error writing frame cache \"" << path << "\": "
+              << strerror( errno ) );
+}
+
+bool FrameCache::valid( const string &source, const string &typecode, int step,
+                        int cropX, int cropY, int cropWidth, int cropHeight ) const
+{
+  // The cache is invalid as soon as the source file was modified.
+  long long size, time;
+  if ( !sourceStat( source, &size, &time ) ) return false;
+  return size == m_header->sourceSize && time == m_header->sourceTime &&
+    typecode == this->typecode() && step == m_header->step &&
+    cropX == m_header->cropX && cropY == m_header->cropY &&
+    cropWidth == m_header->cropWidth && cropHeight == m_header->cropHeight;
+}
+
+string FrameCache::typecode(void) const
+{
+  return string( m_header->typecode, strnlen( m_header->typecode,
+                                              sizeof( m_header->typecode ) ) );
+}
+
+AVRational FrameCache::timeBase(void) const
+{
+  AVRational retVal;
+  retVal.num = m_header->timeBaseNum;
+  retVal.den = m_header->timeBaseDen;
+  return retVal;
+}
+
+int FrameCache::find( long long pts, bool backward ) const
+{
+  const long long *begin = m_pts, *end = m_pts + m_header->count;
+  const long long *i = lower_bound( begin, end, pts );
+  if ( backward && ( i == end || *i > pts ) && i != begin ) i--;
+  return i - begin;
+}
+
+FramePtr FrameCache::frame( int index, VALUE rbOwner ) throw (Error)
+{
+  ERRORMACRO( index >= 0 && index < size(), Error, , "Frame " << index
+              << " is not in frame cache \"" << m_path << "\"" );
+  char *data = m_map + m_header->dataOffset + index * m_header->slotSize;
+  FramePtr retVal( new Frame( typecode(), width(), height(), data ) );
+  // The mapping stays alive as long as the memory of a frame refers to it.
+  rb_ivar_set( rb_funcall( retVal->rubyObject(), Frame::idMemory, 0 ),
+               rb_intern( "@owner" ), rbOwner );
+  return retVal;
+}
+
+bool FrameCache::sourceStat( const string &source, long long *size,
+                             long long *time )
+{
+  struct stat st;
+  if ( stat( source.c_str(), &st ) != 0 || !S_ISREG( st.st_mode ) ) return false;
+  *size = st.st_size;
+  // Nanoseconds tell apart rewrites within the same second.
+  *time = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  return true;
+}
+
+VALUE FrameCache::registerRubyClass( VALUE rbModule )
+{
+  cRubyClass = rb_define_class_under( rbModule, "FrameCache", rb_cObject );
+  rb_define_singleton_method( cRubyClass, "load", RUBY_METHOD_FUNC( wrapLoad ), 8 );
+  rb_define_singleton_method( cRubyClass, "build", RUBY_METHOD_FUNC( wrapBuild ),
+                              8 );
+  rb_define_method( cRubyClass, "size", RUBY_METHOD_FUNC( wrapSize ), 0 );
+  return cRubyClass;
+}
+
+void FrameCache::deleteRubyObject( void *ptr )
+{
+  delete (FrameCachePtr *)ptr;
+}
+
+VALUE FrameCache::wrapLoad( VALUE rbClass, VALUE rbPath, VALUE rbSource,
+                            VALUE rbGray, VALUE rbStep, VALUE rbCropX,
+                            VALUE rbCropY, VALUE rbCropWidth, VALUE rbCropHeight )
+{
+  // A missing, incomplete or outdated cache is reported as nil.
+  VALUE retVal = Qnil;
+  rb_check_type( rbPath, T_STRING );
+  rb_check_type( rbSource, T_STRING );
+  try {
+    FrameCachePtr ptr( new FrameCache( StringValuePtr( rbPath ) ) );
+    if ( ptr->valid( StringValuePtr( rbSource ), rbGray == Qtrue ? "UBYTE" : "YV12",
+                     NUM2INT( rbStep ), NUM2INT( rbCropX ), NUM2INT( rbCropY ),
+                     NUM2INT( rbCropWidth ), NUM2INT( rbCropHeight ) ) )
+      retVal = TypedData_Wrap_Struct( rbClass, &dataType,
+                                      new FrameCachePtr( ptr ) );
+  } catch ( exception &e ) {
+    retVal = Qnil;
+  };
+  return retVal;
+}
+
+VALUE FrameCache::wrapBuild( VALUE, VALUE rbPath, VALUE rbSource,
+                             VALUE rbInput, VALUE rbStep, VALUE rbCropX,
+                             VALUE rbCropY, VALUE rbCropWidth, VALUE rbCropHeight )
+{
+  try {
+    rb_check_type( rbPath, T_STRING );
+    rb_check_type( rbSource, T_STRING );
+    AVInputPtr *input;
+    TypedData_Get_Struct( rbInput, AVInputPtr, &AVInput::dataType, input );
+    build( StringValuePtr( rbPath ), StringValuePtr( rbSource ), *input,
+           NUM2INT( rbStep ), NUM2INT( rbCropX ), NUM2INT( rbCropY ),
+           NUM2INT( rbCropWidth ), NUM2INT( rbCropHeight ) );
+  } catch ( exception &e ) {
+    rb_raise( rb_eRuntimeError, "%s", e.what() );
+  };
+  return rbPath;
+}
+
+VALUE FrameCache::wrapSize( VALUE rbSelf )
+{
+  FrameCachePtr *self;
+  TypedData_Get_Struct( rbSelf, FrameCachePtr, &FrameCache::dataType, self );
+  return INT2NUM( (*self)->size() );
+}
@@ -0,0 +1,85 @@
+/* HornetsEye - Computer Vision with Ruby
+   Copyright (C) 2006, 2007, 2008, 2009, 2010   Jan Wedekind
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef FRAMECACHE_HH
+#define FRAMECACHE_HH
+
+#include <string>
+#include <boost/shared_ptr.hpp>
+#include "avinput.hh"
+
+class FrameCache
+{
+public:
+  FrameCache( const std::string &path ) throw (Error);
+  virtual ~FrameCache(void);
+  static void build( const std::string &path, const std::string &source,
+                     AVInputPtr input, int step, int cropX, int cropY,
+                     int cropWidth, int cropHeight ) throw (Error);
+  bool valid( const std::string &source, const std::string &typecode, int step,
+              int cropX, int cropY, int cropWidth, int cropHeight ) const;
+  std::string typecode(void) const;
+  int width(void) const { return m_header->width; }
+  int height(void) const { return m_header->height; }
+  int size(void) const { return (int)m_header->count; }
+  AVRational timeBase(void) const;
+  long long pts( int index ) const { return m_pts[ index ]; }
+  int find( long long pts, bool backward = false ) const;
+  FramePtr frame( int index, VALUE rbOwner ) throw (Error);
+  static VALUE cRubyClass;
+  static VALUE registerRubyClass( VALUE rbModule );
+  static void deleteRubyObject( void *ptr );
+  static const rb_data_type_t dataType;
+  static VALUE wrapLoad( VALUE rbClass, VALUE rbPath, VALUE rbSource, VALUE rbGray,
+                         VALUE rbStep, VALUE rbCropX, VALUE rbCropY,
+                         VALUE rbCropWidth, VALUE rbCropHeight );
+  static VALUE wrapBuild( VALUE rbClass, VALUE rbPath, VALUE rbSource,
+                          VALUE rbInput, VALUE rbStep, VALUE rbCropX,
+                          VALUE rbCropY, VALUE rbCropWidth, VALUE rbCropHeight );
+  static VALUE wrapSize( VALUE rbSelf );
+protected:
+  struct Header {
+    char magic[8];
+    int version;
+    int complete;
+    long long sourceSize;
+    long long sourceTime; // nanoseconds
+    char typecode[16];
+    int width;
+    int height;
+    int step;
+    int cropX;
+    int cropY;
+    int cropWidth;
+    int cropHeight;
+    int timeBaseNum;
+    int timeBaseDen;
+    long long count;
+    long long slotSize;
+    long long dataOffset;
+    long long ptsOffset;
+  };
+  static bool sourceStat( const std::string &source, long long *size,
+                          long long *time );
+  std::string m_path;
+  char *m_map;
+  size_t m_mapSize;
+  const Header *m_header;
+  const long long *m_pts;
+};
+
+typedef boost::shared_ptr< FrameCache > FrameCachePtr;
+
+#endif
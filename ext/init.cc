@@ -13,8 +13,14 @@
 
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "frame.hh"
+#include "sequence.hh"
 #include "avinput.hh"
 #include "avoutput.hh"
+#include "thumbnailer.hh"
+#include "transcoder.hh"
+#include "ladder.hh"
+#include "framecache.hh"
 
 #ifdef WIN32
 #define DLLEXPORT __declspec(dllexport)
@@ -35,8 +41,14 @@ extern "C" {
     VALUE rbHornetseye = rb_define_module( "Hornetseye" );
     avcodec_register_all();
     av_register_all();
+    Frame::registerRubyClass( rbHornetseye );
+    Sequence::registerRubyClass( rbHornetseye );
     AVInput::registerRubyClass( rbHornetseye );
     AVOutput::registerRubyClass( rbHornetseye );
+    Thumbnailer::registerRubyClass( rbHornetseye );
+    Transcoder::registerRubyClass( rbHornetseye );
+    Ladder::registerRubyClass( rbHornetseye );
+    FrameCache::registerRubyClass( rbHornetseye );
     rb_require( "hornetseye_ffmpeg_ext.rb" );
   }
 
@@ -0,0 +1,129 @@
+/* HornetsEye - Computer Vision with Ruby
+   Copyright (C) 2006, 2007, 2008, 2009, 2010   Jan Wedekind
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <algorithm>
+#include "ladder.hh"
+
+using namespace std;
+
+VALUE Ladder::cRubyClass = Qnil;
+
+const rb_data_type_t Ladder::dataType = {
+  "Hornetseye::Ladder",
+  { 0, deleteRubyObject, 0, 0, { 0 } },
+  0, 0, 0
+};
+
+static bool largerOutput( AVOutputPtr a, AVOutputPtr b )
+{
+  return a->width() * a->height() > b->width() * b->height();
+}
+
+Ladder::Ladder( const vector< AVOutputPtr > &outputs, int queueSize )
+  throw (Error):
+  m_outputs( outputs )
+{
+  ERRORMACRO( !m_outputs.empty(), Error, , "Ladder requires at least one output" );
+  // Every rendition is scaled from the next larger one.
+  stable_sort( m_outputs.begin(), m_outputs.end(), largerOutput );
+  for ( unsigned int i=0; i<m_outputs.size(); i++ ) {
+    // The renditions are encoded in parallel by the threads of the outputs.
+    if ( !m_outputs[i]->async() ) m_outputs[i]->startThreads( queueSize, false );
+    m_swsContexts.push_back( NULL );
+  };
+}
+
+Ladder::~Ladder(void)
+{
+  for ( unsigned int i=0; i<m_swsContexts.size(); i++ )
+    if ( m_swsContexts[i] ) sws_freeContext( m_swsContexts[i] );
+}
+
+void Ladder::writeVideo( FramePtr frame, long long time ) throw (Error)
+{
+  AVFrame picture;
+  AVOutput::frameLayout( frame, &picture );
+  AVFrame *source = &picture, *previous = NULL;
+  try {
+    for ( unsigned int i=0; i<m_outputs.size(); i++ ) {
+      AVFrame *target = m_outputs[i]->allocVideoFrame();
+      m_swsContexts[i] =
+        sws_getCachedContext( m_swsContexts[i], source->width, source->height,
+                              (enum AVPixelFormat)source->format, target->width,
+                              target->height, (enum AVPixelFormat)target->format,
+                              SWS_AREA, 0, 0, 0 );
+      if ( m_swsContexts[i] == NULL ) av_frame_free( &target );
+      ERRORMACRO( m_swsContexts[i] != NULL, Error, , "Error creating scaling "
+                  "context for rendition " << target->width << 'x'
+                  << target->height );
+      sws_scale( m_swsContexts[i], source->data, source->linesize, 0,
+                 source->height, target->data, target->linesize );
+      if ( previous != NULL ) av_frame_free( &previous );
+      previous = target;
+      source = target;
+      m_outputs[i]->writeScaledVideo( target, time );
+    };
+  } catch ( Error &e ) {
+    if ( previous != NULL ) av_frame_free( &previous );
+    throw e;
+  };
+  av_frame_free( &previous );
+}
+
+VALUE Ladder::registerRubyClass( VALUE rbModule )
+{
+  cRubyClass = rb_define_class_under( rbModule, "Ladder", rb_cObject );
+  rb_define_singleton_method( cRubyClass, "new", RUBY_METHOD_FUNC( wrapNew ), 2 );
+  rb_define_method( cRubyClass, "write_video", RUBY_METHOD_FUNC( wrapWriteVideo ), 2 );
+  return cRubyClass;
+}
+
+void Ladder::deleteRubyObject( void *ptr )
+{
+  delete (LadderPtr *)ptr;
+}
+
+VALUE Ladder::wrapNew( VALUE rbClass, VALUE rbOutputs, VALUE rbQueueSize )
+{
+  VALUE retVal = Qnil;
+  try {
+    rb_check_type( rbOutputs, T_ARRAY );
+    vector< AVOutputPtr > outputs;
+    for ( int i=0; i<RARRAY_LEN( rbOutputs ); i++ ) {
+      AVOutputPtr *output;
+      TypedData_Get_Struct( rb_ary_entry( rbOutputs, i ), AVOutputPtr,
+                            &AVOutput::dataType, output );
+      outputs.push_back( *output );
+    };
+    LadderPtr ptr( new Ladder( outputs, NUM2INT( rbQueueSize ) ) );
+    retVal = TypedData_Wrap_Struct( rbClass, &dataType, new LadderPtr( ptr ) );
+  } catch ( exception &e ) {
+    rb_raise( rb_eRuntimeError, "%s", e.what() );
+  };
+  return retVal;
+}
+
+VALUE Ladder::wrapWriteVideo( VALUE rbSelf, VALUE rbFrame, VALUE rbTime )
+{
+  try {
+    LadderPtr *self;
+    TypedData_Get_Struct( rbSelf, LadderPtr, &Ladder::dataType, self );
+    FramePtr frame( new Frame( rbFrame ) );
+    (*self)->writeVideo( frame, NUM2LL( rbTime ) );
+  } catch ( exception &e ) {
+    rb_raise( rb_eRuntimeError, "%s", e.what() );
+  };
+  return rbFrame;
+}
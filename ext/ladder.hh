@@ -0,0 +1,43 @@
+/* HornetsEye - Computer Vision with Ruby
+   Copyright (C) 2006, 2007, 2008, 2009, 2010   Jan Wedekind
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef LADDER_HH
+#define LADDER_HH
+
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include "avoutput.hh"
+
+class Ladder
+{
+public:
+  Ladder( const std::vector< AVOutputPtr > &outputs, int queueSize = 8 )
+    throw (Error);
+  virtual ~Ladder(void);
+  void writeVideo( FramePtr frame, long long time = AV_NOPTS_VALUE ) throw (Error);
+  static VALUE cRubyClass;
+  static VALUE registerRubyClass( VALUE rbModule );
+  static void deleteRubyObject( void *ptr );
+  static const rb_data_type_t dataType;
+  static VALUE wrapNew( VALUE rbClass, VALUE rbOutputs, VALUE rbQueueSize );
+  static VALUE wrapWriteVideo( VALUE rbSelf, VALUE rbFrame, VALUE rbTime );
+protected:
+  std::vector< AVOutputPtr > m_outputs;
+  std::vector< struct SwsContext * > m_swsContexts;
+};
+
+typedef boost::shared_ptr< Ladder > LadderPtr;
+
+#endif
@@ -20,10 +20,17 @@
 #undef RSHIFT
 #endif
 
+// Declare gettimeofday before renaming it so that Boost headers can use it.
+#ifndef WIN32
+#include <sys/time.h>
+#endif
 #define gettimeofday rubygettimeofday
 #define timezone rubygettimezone
 #include <ruby.h>
-// #include <version.h>
+#include <ruby/version.h>
+#if defined(RUBY_API_VERSION_CODE) && RUBY_API_VERSION_CODE >= 20000
+#include <ruby/thread.h>
+#endif
 #undef timezone
 #undef gettimeofday
 #ifdef read
@@ -50,5 +57,20 @@
 #define xfree free
 #endif
 
+// Call a blocking function without the global VM lock so that other Ruby
+// threads keep running. The unblocking function is called to interrupt it.
+// Pending interrupts are not raised, so the caller can clean up first. The
+// return value is NULL if the function was not called at all.
+inline void *callWithoutGVL( void *(*func)( void * ), void *data,
+                             void (*unblock)( void * ) )
+{
+#if defined(RUBY_API_VERSION_CODE) && RUBY_API_VERSION_CODE >= 20000
+  return rb_thread_call_without_gvl2( func, data, unblock, data );
+#else
+  (void)unblock;
+  return func( data );
+#endif
+}
+
 #endif
 
@@ -13,34 +13,27 @@
 
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "frame.hh"
 #include "sequence.hh"
 
 using namespace std;
 
-Sequence::Sequence( int size ):
-  m_sequence( Qnil )
-{
-  VALUE mModule = rb_define_module( "Hornetseye" );
-  VALUE cMalloc = rb_define_class_under( mModule, "Malloc", rb_cObject );
-  VALUE cSequence = rb_define_class_under( mModule, "Sequence", rb_cObject );
-  VALUE rbSize = INT2NUM( size );
-  VALUE rbMemory = rb_funcall( cMalloc, rb_intern( "new" ), 1, rbSize );
-  m_sequence = rb_funcall( cSequence, rb_intern( "import" ), 3,
-                           rb_const_get( mModule, rb_intern( "UBYTE" ) ),
-                           rbMemory, rbSize );
-}
+VALUE Sequence::cSequence = Qnil;
 
-int Sequence::size(void)
+Sequence::Sequence( int size ):
+  m_sequence( Qnil ), m_size( size )
 {
-  return NUM2INT( rb_funcall( m_sequence, rb_intern( "size" ), 0 ) );
+  VALUE rbMemory = Frame::allocMemory( size, &m_data );
+  m_sequence = rb_funcall( cSequence, Frame::idImport, 3,
+                           Frame::typecodeObject( "UBYTE" ), rbMemory,
+                           INT2NUM( size ) );
 }
 
-char *Sequence::data(void)
+Sequence::Sequence( VALUE rbSequence ):
+  m_sequence( rbSequence )
 {
-  VALUE rbMemory = rb_funcall( m_sequence, rb_intern( "memory" ), 0 );
-  char *ptr;
-  Data_Get_Struct( rbMemory, char, ptr );
-  return ptr;
+  m_size = NUM2INT( rb_funcall( m_sequence, Frame::idSize, 0 ) );
+  m_data = Frame::memoryData( rb_funcall( m_sequence, Frame::idMemory, 0 ) );
 }
 
 void Sequence::markRubyMember(void)
@@ -48,3 +41,8 @@ void Sequence::markRubyMember(void)
   rb_gc_mark( m_sequence );
 }
 
+VALUE Sequence::registerRubyClass( VALUE rbModule )
+{
+  cSequence = rb_define_class_under( rbModule, "Sequence", rb_cObject );
+  return cSequence;
+}
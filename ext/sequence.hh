@@ -24,14 +24,18 @@ class Sequence
 {
 public:
   Sequence( int size );
-  Sequence( VALUE rbSequence ): m_sequence( rbSequence ) {}
+  Sequence( VALUE rbSequence );
   virtual ~Sequence(void) {}
-  int size(void);
-  char *data(void);
+  int size(void) { return m_size; }
+  char *data(void) { return m_data; }
   VALUE rubyObject(void) { return m_sequence; }
   void markRubyMember(void);
+  static VALUE registerRubyClass( VALUE rbModule );
+  static VALUE cSequence;
 protected:
   VALUE m_sequence;
+  int m_size;
+  char *m_data;
 };
 
 typedef boost::shared_ptr< Sequence > SequencePtr;
@@ -0,0 +1,232 @@
+/* HornetsEye - Computer Vision with Ruby
+   Copyright (C) 2006, 2007, 2008, 2009, 2010   Jan Wedekind
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include "thumbnailer.hh"
+
+using namespace std;
+
+VALUE Thumbnailer::cRubyClass = Qnil;
+
+Thumbnailer::Thumbnailer( const string &mrl, int width, int height, int threads )
+  throw (Error):
+  m_mrl( mrl ), m_width( width & ~0x1 ), m_height( height & ~0x1 ),
+  m_threads( threads ), m_columns( 0 )
+{
+  ERRORMACRO( m_width > 0 && m_height > 0, Error, , "Thumbnail size must be at "
+              "least 2x2 (but was " << width << 'x' << height << ")" );
+  if ( m_threads <= 0 )
+    m_threads = max( (int)boost::thread::hardware_concurrency(), 1 );
+  // The first input is also used to query the duration of the video.
+  m_input = AVInputPtr( new AVInput( mrl, false ) );
+  ERRORMACRO( m_input->hasVideo(), Error, , "File \"" << mrl << "\" does not have "
+              "a video stream" );
+  m_input->fastDecode( m_width, m_height );
+}
+
+void Thumbnailer::evenlySpaced( int count ) throw (Error)
+{
+  long long duration = m_input->duration();
+  ERRORMACRO( duration != AV_NOPTS_VALUE, Error, , "Duration of video \""
+              << m_mrl << "\" is unknown" );
+  AVRational timeBase = m_input->videoTimeBase();
+  long long start = m_input->videoStartTime();
+  if ( start == AV_NOPTS_VALUE ) start = 0;
+  start = av_rescale_q( start, timeBase, AV_TIME_BASE_Q );
+  duration = av_rescale_q( duration, timeBase, AV_TIME_BASE_Q );
+  for ( int i=0; i<count; i++ )
+    addTime( start + av_rescale( 2 * i + 1, duration, 2 * count ) );
+}
+
+void Thumbnailer::addTime( long long timestamp )
+{
+  m_times.push_back( timestamp );
+}
+
+VALUE Thumbnailer::extract( int *state ) throw (Error)
+{
+  // A Ruby exception while allocating the frames is passed on in state.
+  m_columns = 0;
+  VALUE retVal = rb_protect( allocTargets, (VALUE)this, state );
+  if ( *state == 0 ) run();
+  return retVal;
+}
+
+VALUE Thumbnailer::extractGrid( int columns, int *state ) throw (Error)
+{
+  ERRORMACRO( columns > 0, Error, , "Number of columns must be positive" );
+  m_columns = columns;
+  VALUE retVal = rb_protect( allocTargets, (VALUE)this, state );
+  if ( *state == 0 ) run();
+  return retVal;
+}
+
+VALUE Thumbnailer::allocTargets( VALUE ptr )
+{
+  Thumbnailer *self = (Thumbnailer *)ptr;
+  int count = (int)self->m_times.size(), columns = self->m_columns;
+  self->m_targets.clear();
+  if ( columns > 0 ) {
+    int rows = ( count + columns - 1 ) / columns;
+    FramePtr frame( new Frame( "YV12", columns * self->m_width,
+                               max( rows, 1 ) * self->m_height ) );
+    clear( frame );
+    for ( int i=0; i<count; i++ )
+      self->m_targets.push_back( yv12Target( frame, ( i % columns ) * self->m_width,
+                                             ( i / columns ) * self->m_height ) );
+    return frame->rubyObject();
+  };
+  // Frames are kept in a Ruby array so that they are not garbage collected.
+  VALUE retVal = rb_ary_new();
+  for ( int i=0; i<count; i++ ) {
+    FramePtr frame( new Frame( "YV12", self->m_width, self->m_height ) );
+    rb_ary_push( retVal, frame->rubyObject() );
+    clear( frame );
+    self->m_targets.push_back( yv12Target( frame, 0, 0 ) );
+  };
+  return retVal;
+}
+
+void Thumbnailer::clear( FramePtr frame )
+{
+  int luma = frame->lineSize( 0 ) * frame->height();
+  memset( frame->data(), 16, luma );
+  memset( frame->data() + luma, 128, frame->storageSize() - luma );
+}
+
+Thumbnailer::Target Thumbnailer::yv12Target( FramePtr frame, int x, int y )
+{
+  Target retVal;
+  for ( int i=0; i<3; i++ ) {
+    int scale = i == 0 ? 1 : 2;
+    retVal.linesize[i] = frame->lineSize( i );
+    retVal.data[i] = (uint8_t *)frame->plane( i ) +
+                     ( y / scale ) * retVal.linesize[i] + x / scale;
+  };
+  return retVal;
+}
+
+void Thumbnailer::run(void) throw (Error)
+{
+  m_error.clear();
+  // Decoding does not use Ruby, so other Ruby threads keep running.
+  if ( callWithoutGVL( runWithoutGVL, this, interrupt ) == NULL )
+    interrupt( this );
+  ERRORMACRO( m_error.empty(), Error, , m_error );
+}
+
+void *Thumbnailer::runWithoutGVL( void *ptr )
+{
+  Thumbnailer *self = (Thumbnailer *)ptr;
+  int threads = min( self->m_threads, (int)self->m_times.size() );
+  boost::thread_group group;
+  for ( int i=1; i<threads; i++ )
+    group.create_thread( boost::bind( &Thumbnailer::work, self, i ) );
+  if ( threads > 0 ) self->work( 0 );
+  group.join_all();
+  return ptr;
+}
+
+void Thumbnailer::interrupt( void *ptr )
+{
+  Thumbnailer *self = (Thumbnailer *)ptr;
+  boost::mutex::scoped_lock lock( self->m_mutex );
+  if ( self->m_error.empty() )
+    self->m_error = "Extracting thumbnails was interrupted";
+}
+
+void Thumbnailer::work( int worker )
+{
+  struct SwsContext *swsContext = NULL;
+  try {
+    // Every worker thread opens the file once.
+    AVInputPtr input = m_input;
+    if ( worker > 0 ) {
+      input = AVInputPtr( new AVInput( m_mrl, false ) );
+      input->fastDecode( m_width, m_height );
+    };
+    for ( unsigned int i=worker; i<m_times.size() && !failed(); i+=m_threads ) {
+      AVFrame *frame = input->decodeKeyFrame( m_times[i] );
+      if ( frame == NULL ) continue;
+      swsContext = sws_getCachedContext( swsContext, frame->width, frame->height,
+                                         (enum AVPixelFormat)frame->format,
+                                         m_width, m_height, AV_PIX_FMT_YUV420P,
+                                         SWS_AREA, 0, 0, 0 );
+      ERRORMACRO( swsContext != NULL, Error, , "Error creating scaling context" );
+      sws_scale( swsContext, frame->data, frame->linesize, 0, frame->height,
+                 m_targets[i].data, m_targets[i].linesize );
+    };
+  } catch ( exception &e ) {
+    boost::mutex::scoped_lock lock( m_mutex );
+    m_error = e.what();
+  };
+  if ( swsContext ) sws_freeContext( swsContext );
+}
+
+bool Thumbnailer::failed(void)
+{
+  boost::mutex::scoped_lock lock( m_mutex );
+  return !m_error.empty();
+}
+
+VALUE Thumbnailer::registerRubyClass( VALUE rbModule )
+{
+  cRubyClass = rb_define_class_under( rbModule, "Thumbnailer", rb_cObject );
+  rb_define_singleton_method( cRubyClass, "extract",
+                              RUBY_METHOD_FUNC( wrapExtract ), 6 );
+  return cRubyClass;
+}
+
+VALUE Thumbnailer::wrapExtract( VALUE, VALUE rbMRL, VALUE rbTimes,
+                                VALUE rbWidth, VALUE rbHeight, VALUE rbColumns,
+                                VALUE rbThreads )
+{
+  // Ruby arguments are converted before the thumbnailer exists, because a
+  // conversion error would skip its destructor.
+  rb_check_type( rbMRL, T_STRING );
+  int width = NUM2INT( rbWidth ), height = NUM2INT( rbHeight ),
+    threads = NUM2INT( rbThreads ), count = 0;
+  int columns = rbColumns != Qnil ? NUM2INT( rbColumns ) : 0;
+  if ( TYPE( rbTimes ) == T_ARRAY ) {
+    VALUE rbCopy = rb_ary_new();
+    for ( int i=0; i<RARRAY_LEN( rbTimes ); i++ )
+      rb_ary_push( rbCopy, LL2NUM( NUM2LL( rb_ary_entry( rbTimes, i ) ) ) );
+    rbTimes = rbCopy;
+  } else
+    count = NUM2INT( rbTimes );
+  VALUE retVal = Qnil;
+  int state = 0;
+  try {
+    Thumbnailer thumbnailer( StringValuePtr( rbMRL ), width, height, threads );
+    if ( TYPE( rbTimes ) == T_ARRAY ) {
+      for ( int i=0; i<RARRAY_LEN( rbTimes ); i++ )
+        thumbnailer.addTime( NUM2LL( rb_ary_entry( rbTimes, i ) ) );
+    } else
+      thumbnailer.evenlySpaced( count );
+    if ( rbColumns != Qnil )
+      retVal = thumbnailer.extractGrid( columns, &state );
+    else
+      retVal = thumbnailer.extract( &state );
+  } catch ( exception &e ) {
+    // An interrupt such as Ctrl-C is raised as such.
+    rb_thread_check_ints();
+    rb_raise( rb_eRuntimeError, "%s", e.what() );
+  };
+  if ( state != 0 ) rb_jump_tag( state );
+  return retVal;
+}
+
@@ -0,0 +1,65 @@
+/* HornetsEye - Computer Vision with Ruby
+   Copyright (C) 2006, 2007, 2008, 2009, 2010   Jan Wedekind
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef THUMBNAILER_HH
+#define THUMBNAILER_HH
+
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include "avinput.hh"
+
+class Thumbnailer
+{
+public:
+  Thumbnailer( const std::string &mrl, int width, int height, int threads = 0 )
+    throw (Error);
+  virtual ~Thumbnailer(void) {}
+  void evenlySpaced( int count ) throw (Error);
+  void addTime( long long timestamp );
+  VALUE extract( int *state ) throw (Error);
+  VALUE extractGrid( int columns, int *state ) throw (Error);
+  static VALUE cRubyClass;
+  static VALUE registerRubyClass( VALUE rbModule );
+  static VALUE wrapExtract( VALUE rbClass, VALUE rbMRL, VALUE rbTimes,
+                            VALUE rbWidth, VALUE rbHeight, VALUE rbColumns,
+                            VALUE rbThreads );
+protected:
+  struct Target
+  {
+    uint8_t *data[3];
+    int linesize[3];
+  };
+  static void clear( FramePtr frame );
+  static Target yv12Target( FramePtr frame, int x, int y );
+  static VALUE allocTargets( VALUE ptr );
+  void run(void) throw (Error);
+  static void *runWithoutGVL( void *ptr );
+  static void interrupt( void *ptr );
+  void work( int worker );
+  bool failed(void);
+  std::string m_mrl;
+  int m_width;
+  int m_height;
+  int m_threads;
+  int m_columns;
+  AVInputPtr m_input;
+  std::vector< long long > m_times;
+  std::vector< Target > m_targets;
+  std::string m_error;
+  boost::mutex m_mutex;
+};
+
+#endif
@@ -0,0 +1,260 @@
+/* HornetsEye - Computer Vision with Ruby
+   Copyright (C) 2006, 2007, 2008, 2009, 2010   Jan Wedekind
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include "transcoder.hh"
+
+using namespace std;
+
+VALUE Transcoder::cRubyClass = Qnil;
+
+Transcoder::Transcoder( AVInputPtr input, AVOutputPtr output, int queueSize )
+  throw (Error):
+  m_input( input ), m_output( output ), m_queueSize( queueSize ),
+  m_start( AV_NOPTS_VALUE ), m_packets( 4 * queueSize ), m_frames( queueSize ),
+  m_swsContext( NULL )
+{
+  ERRORMACRO( input->hasVideo(), Error, , "Input does not have a video stream" );
+  // Output timestamps count from the earliest start of the streams.
+  AVStream *streams[2] = { input->videoStream(), input->audioStream() };
+  for ( int i=0; i<2; i++ )
+    if ( streams[i] != NULL && streams[i]->start_time != AV_NOPTS_VALUE ) {
+      long long start = av_rescale_q( streams[i]->start_time,
+                                      streams[i]->time_base, AV_TIME_BASE_Q );
+      if ( m_start == AV_NOPTS_VALUE || start < m_start ) m_start = start;
+    };
+  if ( m_start == AV_NOPTS_VALUE ) m_start = 0;
+}
+
+Transcoder::~Transcoder(void)
+{
+  if ( m_swsContext ) sws_freeContext( m_swsContext );
+}
+
+int Transcoder::run( bool callback ) throw (Error)
+{
+  // Encoding and muxing run in the threads of the output.
+  if ( !m_output->async() ) m_output->startThreads( m_queueSize, false );
+  m_error.clear();
+  boost::thread demuxThread( boost::bind( &Transcoder::demux, this ) );
+  boost::thread decodeThread( boost::bind( &Transcoder::decode, this ) );
+  int state = 0;
+  if ( callback )
+    // Scaling and the Ruby callback run on the calling thread.
+    state = convert( true );
+  else if ( callWithoutGVL( convertWithoutGVL, this, interrupt ) == NULL ) {
+    // Interrupted before converting. The decoded frames are discarded.
+    interrupt( this );
+    convert( false );
+  };
+  demuxThread.join();
+  decodeThread.join();
+  if ( state == 0 ) {
+    ERRORMACRO( m_error.empty(), Error, , m_error );
+    if ( callback ) m_output->flush();
+  };
+  return state;
+}
+
+void *Transcoder::convertWithoutGVL( void *ptr )
+{
+  // Without a block, converting and waiting for the encoder do not use Ruby.
+  Transcoder *self = (Transcoder *)ptr;
+  self->convert( false );
+  try {
+    if ( !self->failed() ) self->m_output->flush();
+  } catch ( exception &e ) {
+    self->setError( e.what() );
+  };
+  return ptr;
+}
+
+void Transcoder::interrupt( void *ptr )
+{
+  ( (Transcoder *)ptr )->setError( "Transcoding was interrupted" );
+}
+
+void Transcoder::demux(void)
+{
+  try {
+    while ( !failed() ) {
+      AVPacket *packet = av_packet_alloc();
+      ERRORMACRO( packet != NULL, Error, , "Error allocating packet" );
+      if ( !m_input->readPacket( packet ) ) {
+        av_packet_free( &packet );
+        break;
+      };
+      m_packets.push( packet );
+    };
+  } catch ( exception &e ) {
+    setError( e.what() );
+  };
+  m_packets.push( NULL );
+}
+
+void Transcoder::decode(void)
+{
+  while ( true ) {
+    // Packets are consumed until the end even after an error.
+    AVPacket *packet = m_packets.pop();
+    try {
+      if ( !failed() ) decodePacket( packet );
+    } catch ( exception &e ) {
+      setError( e.what() );
+    };
+    if ( packet == NULL ) break;
+    av_packet_free( &packet );
+  };
+  Item end;
+  end.frame = NULL;
+  end.video = true;
+  end.time = AV_NOPTS_VALUE;
+  m_frames.push( end );
+}
+
+void Transcoder::decodePacket( AVPacket *packet ) throw (Error)
+{
+  // Audio is dropped if the output does not have an audio stream.
+  AVStream *audioStream = m_output->hasAudio() ? m_input->audioStream() : NULL;
+  AVStream *videoStream = m_input->videoStream();
+  if ( packet == NULL ) {
+    // Flush frames delayed by the decoders.
+    AVFrame *frame;
+    while ( ( frame = m_input->decodeVideo( NULL ) ) != NULL )
+      pushFrame( frame, videoStream, true );
+    if ( audioStream != NULL )
+      while ( ( frame = m_input->decodeAudio( NULL ) ) != NULL )
+        pushFrame( frame, audioStream, false );
+  } else if ( packet->stream_index == videoStream->index ) {
+    AVFrame *frame = m_input->decodeVideo( packet );
+    if ( frame != NULL ) pushFrame( frame, videoStream, true );
+  } else if ( audioStream != NULL && packet->stream_index == audioStream->index ) {
+    while ( packet->size > 0 ) {
+      AVFrame *frame = m_input->decodeAudio( packet );
+      if ( frame != NULL ) pushFrame( frame, audioStream, false );
+    };
+  };
+}
+
+void Transcoder::pushFrame( AVFrame *frame, AVStream *stream, bool video )
+  throw (Error)
+{
+  // The decoder reuses its frame, so the data is passed on in a copy.
+  Item item;
+  item.frame = av_frame_clone( frame );
+  ERRORMACRO( item.frame != NULL, Error, , "Error copying decoded frame" );
+  item.video = video;
+  // The source timing is kept so that variable frame rates do not drift.
+  long long pts = frame->best_effort_timestamp;
+  item.time = pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE :
+    av_rescale_q( pts, stream->time_base, AV_TIME_BASE_Q ) - m_start;
+  m_frames.push( item );
+}
+
+int Transcoder::convert( bool callback ) throw (Error)
+{
+  int state = 0;
+  while ( true ) {
+    Item item = m_frames.pop();
+    if ( item.frame == NULL ) break;
+    try {
+      if ( !failed() && state == 0 ) {
+        if ( !item.video )
+          m_output->writeAudio( item.frame, item.time );
+        else if ( callback ) {
+          VALUE rbFrame = rb_protect( yieldFrame, toFrame( item.frame )->rubyObject(),
+                                      &state );
+          if ( state != 0 )
+            setError( "Exception in transcoder callback" );
+          else if ( rbFrame != Qnil )
+            m_output->writeVideo( FramePtr( new Frame( rbFrame ) ), item.time );
+        } else
+          m_output->writeVideo( item.frame, item.time );
+      };
+    } catch ( exception &e ) {
+      setError( e.what() );
+    };
+    av_frame_free( &item.frame );
+  };
+  return state;
+}
+
+FramePtr Transcoder::toFrame( AVFrame *frame ) throw (Error)
+{
+  FramePtr retVal( new Frame( "YV12", frame->width, frame->height ) );
+  int
+    width   = frame->width,
+    height  = frame->height;
+  uint8_t *data[3];
+  int linesize[3];
+  for ( int i=0; i<3; i++ ) {
+    data[i] = (uint8_t *)retVal->plane( i );
+    linesize[i] = retVal->lineSize( i );
+  };
+  m_swsContext = sws_getCachedContext( m_swsContext, width, height,
+                                       (enum AVPixelFormat)frame->format,
+                                       width, height, AV_PIX_FMT_YUV420P,
+                                       SWS_FAST_BILINEAR, 0, 0, 0 );
+  ERRORMACRO( m_swsContext != NULL, Error, , "Error creating scaling context" );
+  sws_scale( m_swsContext, frame->data, frame->linesize, 0, height,
+             data, linesize );
+  return retVal;
+}
+
+VALUE Transcoder::yieldFrame( VALUE rbFrame )
+{
+  return rb_yield( rbFrame );
+}
+
+void Transcoder::setError( const string &error )
+{
+  boost::mutex::scoped_lock lock( m_mutex );
+  if ( m_error.empty() ) m_error = error;
+}
+
+bool Transcoder::failed(void)
+{
+  boost::mutex::scoped_lock lock( m_mutex );
+  return !m_error.empty();
+}
+
+VALUE Transcoder::registerRubyClass( VALUE rbModule )
+{
+  cRubyClass = rb_define_class_under( rbModule, "Transcoder", rb_cObject );
+  rb_define_singleton_method( cRubyClass, "run", RUBY_METHOD_FUNC( wrapRun ), 3 );
+  return cRubyClass;
+}
+
+VALUE Transcoder::wrapRun( VALUE, VALUE rbInput, VALUE rbOutput,
+                           VALUE rbQueueSize )
+{
+  int state = 0;
+  try {
+    AVInputPtr *input;
+    TypedData_Get_Struct( rbInput, AVInputPtr, &AVInput::dataType, input );
+    AVOutputPtr *output;
+    TypedData_Get_Struct( rbOutput, AVOutputPtr, &AVOutput::dataType, output );
+    Transcoder transcoder( *input, *output, NUM2INT( rbQueueSize ) );
+    state = transcoder.run( rb_block_given_p() );
+  } catch ( exception &e ) {
+    // An interrupt such as Ctrl-C is raised as such.
+    rb_thread_check_ints();
+    rb_raise( rb_eRuntimeError, "%s", e.what() );
+  };
+  // Re-raise an exception of the block after the threads have stopped.
+  if ( state != 0 ) rb_jump_tag( state );
+  return rbOutput;
+}
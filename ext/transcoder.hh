@@ -0,0 +1,63 @@
+/* HornetsEye - Computer Vision with Ruby
+   Copyright (C) 2006, 2007, 2008, 2009, 2010   Jan Wedekind
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef TRANSCODER_HH
+#define TRANSCODER_HH
+
+#include <boost/thread/mutex.hpp>
+#include "avinput.hh"
+#include "avoutput.hh"
+#include "boundedqueue.hh"
+
+class Transcoder
+{
+public:
+  Transcoder( AVInputPtr input, AVOutputPtr output, int queueSize = 8 )
+    throw (Error);
+  virtual ~Transcoder(void);
+  int run( bool callback ) throw (Error);
+  static VALUE cRubyClass;
+  static VALUE registerRubyClass( VALUE rbModule );
+  static VALUE wrapRun( VALUE rbClass, VALUE rbInput, VALUE rbOutput,
+                        VALUE rbQueueSize );
+protected:
+  struct Item {
+    AVFrame *frame;
+    bool video;
+    long long time;
+  };
+  void demux(void);
+  void decode(void);
+  void decodePacket( AVPacket *packet ) throw (Error);
+  void pushFrame( AVFrame *frame, AVStream *stream, bool video ) throw (Error);
+  int convert( bool callback ) throw (Error);
+  static void *convertWithoutGVL( void *ptr );
+  static void interrupt( void *ptr );
+  FramePtr toFrame( AVFrame *frame ) throw (Error);
+  static VALUE yieldFrame( VALUE rbFrame );
+  void setError( const std::string &error );
+  bool failed(void);
+  AVInputPtr m_input;
+  AVOutputPtr m_output;
+  int m_queueSize;
+  long long m_start;
+  BoundedQueue< AVPacket * > m_packets;
+  BoundedQueue< Item > m_frames;
+  struct SwsContext *m_swsContext;
+  std::string m_error;
+  boost::mutex m_mutex;
+};
+
+#endif
@@ -23,18 +23,67 @@ module Hornetseye
 
       alias_method :orig_new, :new
 
-      def new( mrl, audio = true )
-        retval = orig_new mrl, audio
+      def new( mrl, audio = true, options = {} )
+        live = options[ :live ] ? true : false
+        max_latency = options[ :max_latency ] || 0.5
+        motion_vectors = options[ :motion_vectors ] ? true : false
+        retval = orig_new mrl, audio, options[ :gray ] ? true : false, live,
+                          max_latency.to_f, motion_vectors
         retval.instance_eval do
+          @max_latency = live ? max_latency : nil
+          @export_motion_vectors = motion_vectors
+          @picture_type = nil
+          @motion_vectors = nil
+          @qp_table = nil
           @frame = nil
           @video = Queue.new
           @audio = Queue.new
+          @audio_samples = 0
           @video_pts = AV_NOPTS_VALUE
           @audio_pts = AV_NOPTS_VALUE
         end
+        # :cache => bytes keeps decoded frames for seeking back and forth
+        retval.cache_size = options[ :cache ] if options[ :cache ]
+        # :frame_cache => path (or true) decodes the video once into a mapped file
+        # which is reused by later runs until the source changes. Use
+        # :decimate => n to keep every n-th frame and :crop => [x, y, w, h].
+        # Only video frames are read from the cache. They come without motion
+        # vectors and QP tables
+        if options[ :frame_cache ]
+          retval.frame_cache = frame_cache( mrl, options )
+        end
+        retval
+      end
+
+      def frame_cache( mrl, options )
+        path = options[ :frame_cache ]
+        path = "#{mrl}.frames" if path == true
+        gray = options[ :gray ] ? true : false
+        args = [ options[ :decimate ] || 1 ] + ( options[ :crop ] || [ 0, 0, 0, 0 ] )
+        retval = FrameCache.load path, mrl, gray, *args
+        unless retval
+          input = new mrl, false, :gray => gray
+          begin
+            FrameCache.build path, mrl, input, *args
+          ensure
+            input.close
+          end
+          retval = FrameCache.load path, mrl, gray, *args
+          raise "Error loading frame cache \"#{path}\"" unless retval
+        end
         retval
       end
 
+      private :frame_cache
+
+      def thumbnails( mrl, times, width, height, options = {} )
+        unless times.is_a? Integer
+          times = times.collect { |t| ( t * AV_TIME_BASE ).to_i }
+        end
+        Thumbnailer.extract mrl, times, width, height, options[ :columns ],
+                            options[ :threads ] || 0
+      end
+
     end
 
     def shape
@@ -43,10 +92,20 @@ module Hornetseye
 
     def read_video
       enqueue_frame while @video.empty?
-      frame, @video_pts = @video.deq
+      frame, @video_pts, @picture_type, @motion_vectors, @qp_table = @video.deq
       frame
     end
 
+    alias_method :orig_picture_type, :picture_type
+
+    def picture_type
+      @picture_type
+    end
+
+    attr_reader :motion_vectors
+
+    attr_reader :qp_table
+
     def read
       has_video? ? read_video : read_audio
     end
@@ -54,18 +113,43 @@ module Hornetseye
     def read_audio
       enqueue_frame while @audio.empty?
       frame, @audio_pts = @audio.deq
+      @audio_samples -= frame.shape.last
       frame
     end
 
     def enqueue_frame
       frame = read_av
-      if frame.is_a? Frame_
-        @video.enq [frame, video_pts]
+      if frame.is_a?( Frame_ ) or frame.dimension == 2
+        @video.enq [frame, video_pts, orig_picture_type] + side_data
         @frame = frame
       else
         n = channels
         samples = MultiArray.import(SINT, frame.memory, n, frame.size / (2 * n))
         @audio.enq [samples, audio_pts]
+        @audio_samples += samples.shape.last
+      end
+      limit_queues if @max_latency
+    end
+
+    def side_data
+      return [] unless @export_motion_vectors
+      data = motion_vector_data
+      mvs = data && data.size > 0 ?
+        MultiArray.import(SINT, data.memory, 7, data.size / 14) : nil
+      qp = qp_data
+      qp = qp ? MultiArray.import(BYTE, qp.memory, qp_stride, qp.size / qp_stride) : nil
+      [mvs, qp]
+    end
+
+    def limit_queues
+      if has_video?
+        rate = frame_rate rescue 0
+        max_frames = [ ( @max_latency * rate ).ceil, 1 ].max
+        @video.deq while @video.size > max_frames
+      end
+      while @audio.size > 1 and @audio_samples > @max_latency * sample_rate
+        samples, = @audio.deq
+        @audio_samples -= samples.shape.last
       end
     end
 
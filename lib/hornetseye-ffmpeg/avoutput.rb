@@ -25,43 +25,161 @@ module Hornetseye
 
       def new( mrl, video_bit_rate, width, height, frame_rate, aspect_ratio = 1,
                video_codec = nil, have_audio = false, audio_bit_rate = 64000,
-               sample_rate = 44100, channels = 2, audio_codec = nil )
+               sample_rate = 44100, channels = 2, audio_codec = nil, options = {} )
         if frame_rate.is_a? Float
           frame_rate = 90000.quo( ( 90000 / frame_rate ).to_i )
         end
+        # :async => true encodes and muxes in background threads with a queue of
+        # :queue_size frames and :backpressure => :block or :drop.
+        # :zero_copy => true lets the encoder read YV12 and I420 frames in place
+        # (frames must not be modified after writing them).
+        # :io => :memory writes to a buffer (see #data) and :io => io writes to an
+        # IO-like object in chunks of :chunk_size bytes. Use :fragmented => true for
+        # MP4 output to a non-seekable IO.
+        # :segment_time => seconds or :segment_size => bytes start a new file at
+        # the next keyframe (mrl must contain a pattern such as %05d). The block
+        # :on_segment is called with the name of every completed file.
+        # :realtime => seconds encodes asynchronously with a latency budget. Frames
+        # are dropped when encoding lags and duplicated when frames come in late
+        # (see #stats)
+        output_options = [ :async, :queue_size, :backpressure, :zero_copy, :io,
+                           :chunk_size, :fragmented, :on_segment, :realtime ]
+        # Encoder options such as :threads => 0, :thread_type => [:frame, :slice],
+        # :preset => 'fast', :crf => 23, :bf => 2 or :g => 250
+        codec_options = options.reject do |key,value|
+          output_options.member? key
+        end.collect do |key,value|
+          value = [ value ].flatten.join '+' if key == :thread_type
+          [ key.to_s, value.to_s ]
+        end
+        if options[ :fragmented ]
+          codec_options.push [ 'movflags', 'frag_keyframe+empty_moov+default_base_moof' ]
+        end
+        io = options[ :io ]
+        sink = io.nil? ? FILE_SINK : io == :memory ? MEMORY_SINK : STREAM_SINK
         retval = orig_new mrl, video_bit_rate, width, height,
                           frame_rate.denominator, frame_rate.numerator,
                           aspect_ratio.numerator, aspect_ratio.denominator,
-                          video_codec || CODEC_ID_NONE,
+                          video_codec || AV_CODEC_ID_NONE,
                           have_audio ? audio_bit_rate : 0,
                           have_audio ? sample_rate : 0,
                           have_audio ? channels : 0,
-                          audio_codec || CODEC_ID_NONE
-        if have_audio
-          retval.instance_eval do
-            @audio_buffer = MultiArray.new SINT, channels, frame_size
-            @audio_samples = 0
-          end
+                          audio_codec || AV_CODEC_ID_NONE, codec_options, sink
+        retval.instance_eval do
+          @io = io if sink == STREAM_SINK
+          @chunk_size = options[ :chunk_size ] || 1 << 20
+          @on_segment = options[ :on_segment ]
+          @segments_reported = 0
+        end
+        retval.zero_copy = true if options[ :zero_copy ]
+        if options[ :realtime ]
+          retval.start_threads options[ :queue_size ] || 8, true,
+                               ( options[ :realtime ] * AVInput::AV_TIME_BASE ).to_i
+        elsif options[ :async ]
+          retval.start_threads options[ :queue_size ] || 8,
+                               options[ :backpressure ] == :drop, 0
         end
         retval
       end
 
+      def remux( input, output, start = nil, stop = nil )
+        output.remux input, start, stop
+      end
+
+    end
+
+    alias_method :orig_close, :close
+
+    def close
+      begin
+        orig_close
+      ensure
+        drain 0
+      end
+      self
+    end
+
+    alias_method :orig_flush, :flush
+
+    def flush
+      orig_flush
+      drain 0
+      self
+    end
+
+    alias_method :orig_copy_packet, :copy_packet
+
+    def copy_packet( input )
+      retval = orig_copy_packet input
+      drain
+      retval
+    end
+
+    alias_method :orig_remux, :remux
+
+    def remux( input, start = nil, stop = nil )
+      orig_remux input, start ? ( start * AVInput::AV_TIME_BASE ).to_i :
+                                AVInput::AV_NOPTS_VALUE,
+                        stop ? ( stop * AVInput::AV_TIME_BASE ).to_i :
+                               AVInput::AV_NOPTS_VALUE
+      drain
+      self
+    end
+
+    def drain( min_size = @chunk_size )
+      if @io
+        chunk = take_data min_size
+        @io.write chunk unless chunk.empty?
+      end
+      if @on_segment
+        completed = segments
+        completed[ @segments_reported .. -1 ].each { |name| @on_segment.call name }
+        @segments_reported = completed.size
+      end
+    end
+
+    private :drain
+
+    alias_method :orig_max_latency, :max_latency
+
+    def max_latency
+      orig_max_latency.quo AVInput::AV_TIME_BASE
     end
 
+    def stats
+      { :dropped => dropped_frames, :duplicated => duplicated_frames,
+        :max_latency => max_latency }
+    end
+
+    NATIVE_TYPECODES = [ 'YV12', 'I420', 'YUY2', 'UYVY', 'RGB', 'RGB24', 'BGR',
+                         'BGRA', 'UBYTE', 'UBYTERGB' ]
+
     alias_method :orig_write_video, :write_video
 
-    def write_video( frame )
-      orig_write_video frame.to_yv12
+    # The optional timestamp is given in seconds
+    def write_video( frame, pts = nil )
+      native = NATIVE_TYPECODES.member?( frame.typecode.to_s ) &&
+        ( frame.is_a?( Frame_ ) || frame.dimension == 2 )
+      time = pts.nil? ? AVInput::AV_NOPTS_VALUE :
+        ( pts * AVInput::AV_TIME_BASE ).to_i
+      orig_write_video native ? frame : frame.to_yv12, time
+      drain
+      frame
     end
 
     alias_method :write, :write_video
 
+    SAMPLE_FORMATS = { SINT => AV_SAMPLE_FMT_S16, INT => AV_SAMPLE_FMT_S32,
+                       SFLOAT => AV_SAMPLE_FMT_FLT }
+
     alias_method :orig_write_audio, :write_audio
 
-    def write_audio( frame )
-      unless frame.typecode == SINT
-        raise "Audio frame must have elements of type SINT (but elements were of " +
-              "type #{frame.typecode})"
+    # Silence of a gap before the timestamp is not encoded
+    def write_audio( frame, pts = nil )
+      format = SAMPLE_FORMATS[ frame.typecode ]
+      unless format
+        raise "Audio frame must have elements of type SINT, INT or SFLOAT (but " +
+              "elements were of type #{frame.typecode})"
       end
       unless frame.dimension == 2
         raise "Audio frame must have 2 dimensions (but had #{frame.dimensions})"
@@ -70,26 +188,11 @@ module Hornetseye
         raise "Audio frame must have #{channels} channels " +
               "(but had #{frame.shape.first})"
       end
-      size = frame_size * 2 * channels
-      remaining = frame
-      while @audio_samples + remaining.shape.last >= frame_size
-        if @audio_samples > 0
-          @audio_buffer[ @audio_samples ... frame_size ] =
-            remaining[ 0 ... frame_size - @audio_samples ]
-          orig_write_audio Sequence.import(UBYTE, @audio_buffer.memory, size)
-          remaining = remaining[ 0 ... channels,
-                                 frame_size - @audio_samples ... remaining.shape.last ]
-          @audio_samples = 0
-        else
-          orig_write_audio Sequence.import(UBYTE, remaining.memory, size)
-          remaining = remaining[ 0 ... channels, frame_size ... remaining.shape.last ]
-        end
-      end
-      if remaining.shape.last > 0
-        @audio_buffer[ 0 ... channels, @audio_samples ... @audio_samples +
-                       remaining.shape.last ] = remaining
-        @audio_samples += remaining.shape.last
-      end
+      size = frame.shape.last * channels * frame.typecode.storage_size
+      time = pts.nil? ? AVInput::AV_NOPTS_VALUE :
+        ( pts * AVInput::AV_TIME_BASE ).to_i
+      orig_write_audio Sequence.import( UBYTE, frame.memory, size ), format, time
+      drain
       frame
     end
 
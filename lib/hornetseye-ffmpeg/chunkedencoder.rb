@@ -0,0 +1,110 @@
+# hornetseye-ffmpeg - Read/write video frames using libffmpeg
+# Copyright (C) 2010 Jan Wedekind
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Namespace of Hornetseye computer vision library
+module Hornetseye
+
+  # Encodes a long video with several independent encoders in parallel. Every
+  # chunk of :chunk_frames frames starts with a keyframe and is encoded in the
+  # background. Up to :jobs chunks are encoded at the same time which buffers up
+  # to :jobs * :chunk_frames frames. The chunks are joined when closing the video
+  class ChunkedEncoder
+
+    def initialize( mrl, video_bit_rate, width, height, frame_rate,
+                    aspect_ratio = 1, video_codec = nil, options = {} )
+      if frame_rate.is_a? Float
+        frame_rate = 90000.quo( ( 90000 / frame_rate ).to_i )
+      end
+      @mrl, @video_bit_rate, @width, @height = mrl, video_bit_rate, width, height
+      # The chunks are NUT files so the codec of the joined video is set explicitly
+      video_codec ||= AVOutput.default_video_codec mrl
+      @frame_rate, @aspect_ratio, @video_codec = frame_rate, aspect_ratio,
+                                                 video_codec
+      @chunk_frames = options[ :chunk_frames ] || 250
+      @jobs = options[ :jobs ] || 4
+      @options = options.reject { |key,value| [ :chunk_frames, :jobs ].member? key }
+      @options = @options.merge :async => true, :queue_size => @chunk_frames
+      @chunks = []
+      @running = []
+      @frames = 0
+    end
+
+    def write_video( frame )
+      if @frames % @chunk_frames == 0
+        finish @running.shift if @running.size >= @jobs
+        @chunks.push chunk_name( @chunks.size )
+        @running.push AVOutput.new( @chunks.last, @video_bit_rate, @width, @height,
+                                    @frame_rate, @aspect_ratio, @video_codec,
+                                    false, 64000, 44100, 2, nil, @options )
+      end
+      # Timestamps are counted over all chunks so that they continue when joining
+      @running.last.write_video frame, @frames.quo( @frame_rate )
+      @frames += 1
+      frame
+    end
+
+    alias_method :write, :write_video
+
+    def close
+      begin
+        finish @running.shift until @running.empty?
+        output = nil
+        begin
+          @chunks.each do |name|
+            input = AVInput.new name, false
+            begin
+              output ||= AVOutput.stream_copy @mrl, input
+              output.remux input
+            ensure
+              input.close
+            end
+          end
+        ensure
+          output.close if output
+        end
+      ensure
+        # Stop the remaining encoders and remove the chunks also after an error
+        @running.each do |chunk|
+          begin
+            chunk.close
+          rescue RuntimeError
+          end
+        end
+        @running = []
+        @chunks.each { |name| File.delete name if File.exist? name }
+        @chunks = []
+      end
+      nil
+    end
+
+    # Wait for the encoder of a chunk and raise its errors
+    def finish( output )
+      begin
+        output.flush
+      ensure
+        output.close
+      end
+    end
+
+    def chunk_name( index )
+      "#{@mrl}.#{ '%05d' % index }.nut"
+    end
+
+    private :finish, :chunk_name
+
+  end
+
+end
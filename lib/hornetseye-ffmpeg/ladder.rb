@@ -0,0 +1,75 @@
+# hornetseye-ffmpeg - Read/write video frames using libffmpeg
+# Copyright (C) 2010 Jan Wedekind
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Namespace of Hornetseye computer vision library
+module Hornetseye
+
+  class Ladder
+
+    class << self
+
+      alias_method :orig_new, :new
+
+      # Encode one source into several renditions of decreasing resolution
+      def new( outputs, queue_size = 8 )
+        retval = orig_new outputs, queue_size
+        retval.instance_eval { @outputs = outputs }
+        retval
+      end
+
+    end
+
+    alias_method :orig_write_video, :write_video
+
+    def write_video( frame, pts = nil )
+      native = AVOutput::NATIVE_TYPECODES.member?( frame.typecode.to_s ) &&
+        ( frame.is_a?( Frame_ ) || frame.dimension == 2 )
+      time = pts.nil? ? AVInput::AV_NOPTS_VALUE :
+        ( pts * AVInput::AV_TIME_BASE ).to_i
+      orig_write_video native ? frame : frame.to_yv12, time
+      @outputs.each { |output| output.send :drain }
+      frame
+    end
+
+    alias_method :write, :write_video
+
+    def write_audio( frame, pts = nil )
+      @outputs.each { |output| output.write_audio frame, pts }
+      frame
+    end
+
+    def flush
+      @outputs.each { |output| output.flush }
+      self
+    end
+
+    def close
+      # Every rendition is closed even if one of them failed
+      errors = @outputs.collect do |output|
+        begin
+          output.close
+          nil
+        rescue RuntimeError => e
+          e
+        end
+      end.compact
+      raise errors.first unless errors.empty?
+      nil
+    end
+
+  end
+
+end
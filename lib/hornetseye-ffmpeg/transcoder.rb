@@ -0,0 +1,37 @@
+# hornetseye-ffmpeg - Read/write video frames using libffmpeg
+# Copyright (C) 2010 Jan Wedekind
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+# Namespace of Hornetseye computer vision library
+module Hornetseye
+
+  class Transcoder
+
+    class << self
+
+      alias_method :orig_run, :run
+
+      # The optional block gets every video frame and returns the frame to encode
+      # (or nil to skip it)
+      def run( input, output, queue_size = 8, &action )
+        orig_run input, output, queue_size, &action
+      end
+
+    end
+
+  end
+
+end
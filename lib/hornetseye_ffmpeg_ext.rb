@@ -18,4 +18,7 @@ require 'thread'
 require 'hornetseye_frame'
 require 'hornetseye-ffmpeg/avinput'
 require 'hornetseye-ffmpeg/avoutput'
+require 'hornetseye-ffmpeg/transcoder'
+require 'hornetseye-ffmpeg/ladder'
+require 'hornetseye-ffmpeg/chunkedencoder'
 